@@ -0,0 +1,111 @@
+#include "accuracy.hpp"
+#include "direct_sum.hpp"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+
+double ForceErrorStats::percentile(double p) const {
+    if (errors.empty()) return 0;
+    size_t index = static_cast<size_t>(std::ceil(p * errors.size()));
+    return errors[std::min(std::max(index, size_t(1)), errors.size()) - 1];
+}
+
+ForceReference::ForceReference(const Scenario &bodies, size_t sample_size, unsigned seed) {
+    size_t n = bodies.r.size();
+    std::vector<int> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::mt19937 rng(seed);
+    std::shuffle(order.begin(), order.end(), rng);
+    sample.assign(order.begin(), order.begin() + std::min(sample_size, n));
+
+    // The kernel computes forces on a range of bodies, so put the sample first
+    std::vector<double> masses(n);
+    std::vector<Vector2D> positions(n);
+    for (size_t k = 0; k < n; ++k) {
+        masses[k] = bodies.m[order[k]];
+        positions[k] = bodies.r[order[k]];
+    }
+    BodiesSoA soa;
+    soa.load(masses, positions);
+    direct_sum_forces_segment(soa, 0, sample.size(), G, detect_simd_level());
+
+    forces.resize(sample.size());
+    for (size_t k = 0; k < sample.size(); ++k) forces[k] = Vector2D{soa.fx[k], soa.fy[k]};
+}
+
+ForceErrorStats ForceReference::measure(const Scenario &bodies, const BarnesHutWorkspace &workspace) const {
+    // A scratch workspace, so the caller's keeps no tree of the copied bodies
+    BarnesHutWorkspace scratch;
+    scratch.opening_angle = workspace.opening_angle;
+    scratch.use_quadrupole = workspace.use_quadrupole;
+    scratch.leaf_capacity = workspace.leaf_capacity;
+    scratch.max_depth = workspace.max_depth;
+    Scenario scenario = bodies;
+    barnes_hut_update_step(scenario, scratch, 0.0);
+
+    ForceErrorStats stats;
+    stats.opening_angle = workspace.opening_angle;
+    stats.interactions_per_body = static_cast<double>(scratch.interactions) / std::max<size_t>(bodies.r.size(), 1);
+    for (size_t k = 0; k < sample.size(); ++k) {
+        double exact = std::sqrt(forces[k].norm2());
+        if (exact == 0) continue;
+        stats.errors.push_back(std::sqrt((scenario.f[sample[k]] - forces[k]).norm2()) / exact);
+    }
+    std::sort(stats.errors.begin(), stats.errors.end());
+    return stats;
+}
+
+double tune_opening_angle(const Scenario &bodies, BarnesHutWorkspace &workspace, double error_budget,
+                          double percentile, size_t sample_size, double min_angle, double max_angle) {
+    ForceReference reference(bodies, sample_size);
+    auto error_at = [&](double angle) {
+        workspace.opening_angle = angle;
+        return reference.measure(bodies, workspace).percentile(percentile);
+    };
+
+    double best = min_angle;
+    if (error_at(max_angle) <= error_budget) {
+        best = max_angle;
+    } else {
+        double low = min_angle;
+        double high = max_angle;
+        for (int iteration = 0; iteration < 10; ++iteration) {
+            double middle = 0.5 * (low + high);
+            if (error_at(middle) <= error_budget) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+        best = low;
+    }
+    workspace.opening_angle = best;
+    return best;
+}
+
+double total_energy(const Scenario &bodies, ThreadPool &pool) {
+    size_t n = bodies.r.size();
+    std::vector<double> partial(pool.size(), 0.0);
+    // Rows of the i < j triangle shrink with i, so hand them out in stealable chunks
+    pool.parallel_for_stealing(0, n, 64, [&](int start, int end, int thread_id) {
+        double energy = 0;
+        for (int i = start; i < end; ++i) {
+            energy += 0.5 * bodies.m[i] * bodies.v[i].norm2();
+            for (size_t j = i + 1; j < n; ++j) {
+                double dist = std::sqrt((bodies.r[j] - bodies.r[i]).norm2());
+                if (dist > 0) energy -= G * bodies.m[i] * bodies.m[j] / dist;
+            }
+        }
+        partial[thread_id] += energy;
+    });
+    return std::accumulate(partial.begin(), partial.end(), 0.0);
+}
+
+double energy_drift(Scenario bodies, BarnesHutWorkspace &workspace, double time_step, int steps, ThreadPool &pool) {
+    double initial = total_energy(bodies, pool);
+    for (int step = 0; step < steps; ++step) {
+        barnes_hut_update_step(bodies, workspace, time_step);
+    }
+    return std::abs((total_energy(bodies, pool) - initial) / initial);
+}
@@ -0,0 +1,49 @@
+#ifndef ACCURACY_HPP
+#define ACCURACY_HPP
+
+#include "barnes_hut.hpp"
+#include "thread_pool.hpp"
+#include <vector>
+
+// Relative force errors |F_bh - F_exact| / |F_exact| of one Barnes-Hut pass
+// over a sample of bodies, sorted ascending.
+struct ForceErrorStats {
+    double opening_angle = 0;
+    std::vector<double> errors;
+    double interactions_per_body = 0;
+
+    // Error at fraction p of the sample, e.g. 0.99 for the 99th percentile
+    double percentile(double p) const;
+};
+
+// Exact forces on a random sample of bodies, computed once with the
+// direct-sum kernel, to compare Barnes-Hut settings against.
+class ForceReference {
+public:
+    ForceReference(const Scenario &bodies, size_t sample_size, unsigned seed = 305);
+
+    // Runs one force pass with the walk settings in workspace (the bodies do
+    // not move) and compares it with the reference. The pass uses a workspace
+    // of its own, so a tree workspace keeps for refitting is left alone.
+    ForceErrorStats measure(const Scenario &bodies, const BarnesHutWorkspace &workspace) const;
+
+private:
+    std::vector<int> sample;
+    std::vector<Vector2D> forces;
+};
+
+// Largest opening angle in [min_angle, max_angle] whose error at `percentile`
+// stays within error_budget, found by bisection, for the far field and leaf
+// capacity set in workspace. Error grows with the angle, so this is the
+// cheapest walk that is still accurate enough.
+double tune_opening_angle(const Scenario &bodies, BarnesHutWorkspace &workspace, double error_budget,
+                          double percentile = 0.99, size_t sample_size = 1000,
+                          double min_angle = 0.05, double max_angle = 1.5);
+
+// Kinetic plus potential energy, summed over all pairs on the pool
+double total_energy(const Scenario &bodies, ThreadPool &pool);
+
+// Relative change of the total energy over `steps` Barnes-Hut steps
+double energy_drift(Scenario bodies, BarnesHutWorkspace &workspace, double time_step, int steps, ThreadPool &pool);
+
+#endif // ACCURACY_HPP
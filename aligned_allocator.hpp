@@ -0,0 +1,31 @@
+#ifndef ALIGNED_ALLOCATOR_HPP
+#define ALIGNED_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Allocator handing out `Alignment`-byte aligned storage, so that SIMD loads
+// never straddle a cache line and per-thread slots each start a line of their
+// own. Before C++17, std::allocator only honours alignof(T) up to
+// alignof(max_align_t).
+template <typename T, std::size_t Alignment>
+struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+    T *allocate(std::size_t count) {
+        void *ptr = nullptr;
+        if (posix_memalign(&ptr, Alignment, count * sizeof(T)) != 0) throw std::bad_alloc();
+        return static_cast<T *>(ptr);
+    }
+    void deallocate(T *ptr, std::size_t) { free(ptr); }
+
+    template <typename U> bool operator==(const AlignedAllocator<U, Alignment> &) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U, Alignment> &) const { return false; }
+};
+
+#endif // ALIGNED_ALLOCATOR_HPP
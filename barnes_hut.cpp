@@ -1,61 +1,314 @@
 #include "barnes_hut.hpp"
+#include "linear_quadtree.hpp"
+#include "bounding_box.hpp"
+#include "output_pipeline.hpp"
+#include "accuracy.hpp"
+#include "perf_counters.hpp"
 #include <iostream>
 #include <cmath>
 #include <vector>
-#include <stack>
+#include <algorithm>
+
+QuadNodeArena::~QuadNodeArena() {
+    for (QuadNode *block : blocks) ::operator delete(block);
+}
+
+void QuadNodeArena::grow() {
+    blocks.push_back(static_cast<QuadNode *>(::operator new(block_size * sizeof(QuadNode))));
+}
+
+int QuadNodeArena::allocateSlots(int count) {
+    int first = body_slots.size();
+    body_slots.resize(body_slots.size() + count);
+    return first;
+}
+
+QuadNode *QuadNode::constructBarnesHutTree(Scenario *bodies, QuadNodeArena &arena, double margin) {
+    arena.reset();
+    BoundingSquare<Vector2D> box = bounding_square(bodies->r);
+    double size = box.size + 2 * margin;
+    QuadNode *root =
+        arena.create(bodies, box.center,
+                     Vector2D{size, size}, 0);
+
+    for (size_t i = 0; i < bodies->r.size(); i++) {
+        root->addBody(i);
+    }
+    root->computeQuadrupole();
+
+    return root;
+}
+
+bool QuadNode::refitBarnesHutTree(QuadNode *root, std::vector<int> &migrants, size_t max_migrants) {
+    for (const Vector2D &r : root->scenario->r) {
+        if (!root->isInside(r)) return false;
+    }
+    migrants.clear();
+    root->removeMigrants(migrants);
+    if (migrants.size() > max_migrants) return false;
+
+    for (int id : migrants) {
+        root->addBody(id);
+    }
+    root->refit();
+    return true;
+}
+
+// Takes the bodies that left a leaf out of it, and drops the children left
+// without bodies.
+void QuadNode::removeMigrants(std::vector<int> &migrants) {
+    if (isLeaf()) {
+        int *ids = arena->slots() + first_slot;
+        for (int k = 0; k < num_bodies;) {
+            if (isInside(scenario->r[ids[k]])) {
+                k++;
+            } else {
+                migrants.push_back(ids[k]);
+                ids[k] = ids[--num_bodies];
+            }
+        }
+        if (num_bodies == 0) {
+            first_slot = -1;
+            is_empty = true;
+            m = 0;
+        }
+        return;
+    }
+
+    bool has_children = false;
+    for (int q = 0; q < 4; q++) {
+        if (!children[q]) continue;
+        children[q]->removeMigrants(migrants);
+        if (children[q]->is_empty) {
+            children[q] = nullptr;
+        } else {
+            has_children = true;
+        }
+    }
+    if (!has_children) {
+        is_empty = true;
+        m = 0;
+    }
+}
+
+// Recomputes masses, centers of mass and second moments bottom-up, in one
+// pass, and merges cells holding no more than leaf_capacity bodies into
+// leaves. Returns the bodies below.
+int QuadNode::refit() {
+    Vector2D weighted{0, 0};
+    m = 0;
+    if (isLeaf()) {
+        for (int k = 0; k < num_bodies; k++) {
+            int id = bodyIds()[k];
+            m += scenario->m[id];
+            weighted += scenario->r[id] * scenario->m[id];
+        }
+        center_of_mass = m > 0 ? weighted / m : center;
+        combineQuadrupole();
+        return num_bodies;
+    }
+
+    int count = 0;
+    for (int q = 0; q < 4; q++) {
+        if (!children[q]) continue;
+        count += children[q]->refit();
+        m += children[q]->m;
+        weighted += children[q]->center_of_mass * children[q]->m;
+    }
+    center_of_mass = m > 0 ? weighted / m : center;
+
+    if (count > 0 && count <= arena->leaf_capacity) {
+        // The children are all leaves: any smaller cell has merged already
+        int first = arena->allocateSlots(arena->leaf_capacity);
+        int stored = 0;
+        for (int q = 0; q < 4; q++) {
+            if (!children[q]) continue;
+            const int *ids = children[q]->bodyIds();
+            std::copy(ids, ids + children[q]->num_bodies, arena->slots() + first + stored);
+            stored += children[q]->num_bodies;
+            children[q] = nullptr;
+        }
+        first_slot = first;
+        num_bodies = count;
+    }
+    combineQuadrupole();
+    return count;
+}
+
+void QuadNode::computeQuadrupole() {
+    for (int q = 0; q < 4; q++) {
+        if (children[q]) children[q]->computeQuadrupole();
+    }
+    combineQuadrupole();
+}
+
+void QuadNode::combineQuadrupole() {
+    quad_xx = quad_xy = quad_yy = 0;
+    for (int k = 0; k < num_bodies; k++) {
+        int id = bodyIds()[k];
+        Vector2D d = scenario->r[id] - center_of_mass;
+        quad_xx += scenario->m[id] * d.x * d.x;
+        quad_xy += scenario->m[id] * d.x * d.y;
+        quad_yy += scenario->m[id] * d.y * d.y;
+    }
+    for (int q = 0; q < 4; q++) {
+        QuadNode *child = children[q];
+        if (!child) continue;
+        Vector2D d = child->center_of_mass - center_of_mass;
+        quad_xx += child->quad_xx + child->m * d.x * d.x;
+        quad_xy += child->quad_xy + child->m * d.x * d.y;
+        quad_yy += child->quad_yy + child->m * d.y * d.y;
+    }
+}
+
+// Appends a body to this leaf's slots. Leaves below max_depth never exceed
+// leaf_capacity; deeper ones double their slot block whenever it fills up.
+void QuadNode::storeBody(int index) {
+    int capacity = arena->leaf_capacity;
+    while (capacity < num_bodies) capacity *= 2;
+    if (num_bodies == 0) {
+        first_slot = arena->allocateSlots(capacity);
+    } else if (num_bodies == capacity) {
+        int first = arena->allocateSlots(2 * capacity);
+        std::copy(arena->slots() + first_slot, arena->slots() + first_slot + num_bodies, arena->slots() + first);
+        first_slot = first;
+    }
+    arena->slots()[first_slot + num_bodies++] = index;
+}
 
 void QuadNode::addBody(int index) {
     if (!isInside(scenario->r[index])) return;
 
     if (is_empty) {
-        body_id.push_back(index);
+        storeBody(index);
         updateCenterOfMass(index);
         is_empty = false;
         return;
     }
 
-    if (body_id.size() == 1) {
-        int existing_body = body_id[0];
-        body_id.clear();
+    if (isLeaf()) {
+        if (num_bodies < arena->leaf_capacity || depth >= arena->max_depth) {
+            storeBody(index);
+            updateCenterOfMass(index);
+            return;
+        }
 
-        quad q = getQuad(scenario->r[existing_body]);
-        if (!children[q]) {
-            children[q] = new QuadNode(scenario, getQuadCenter(q), dimension / 2);
+        // Full: push the bodies held so far down into the children
+        for (int k = 0; k < num_bodies; k++) {
+            int existing_body = arena->slots()[first_slot + k];
+            quad q = getQuad(scenario->r[existing_body]);
+            if (!children[q]) {
+                children[q] = arena->create(scenario, getQuadCenter(q), dimension / 2, depth + 1);
+            }
+            children[q]->addBody(existing_body);
         }
-        children[q]->addBody(existing_body);
+        num_bodies = 0;
+        first_slot = -1;
     }
 
     quad q = getQuad(scenario->r[index]);
     if (!children[q]) {
-        children[q] = new QuadNode(scenario, getQuadCenter(q), dimension / 2);
+        children[q] = arena->create(scenario, getQuadCenter(q), dimension / 2, depth + 1);
     }
     children[q]->addBody(index);
 
     updateCenterOfMass(index);
 }
 
-void barnes_hut(Scenario &bodies, double time_step, double total_time, std::vector<std::vector<Vector2D>> &all_positions, std::vector<std::vector<Vector2D>> &all_velocities, std::vector<std::vector<Vector2D>> &all_forces) {
-    for (double t = 0; t < total_time; t += time_step) {
-        barnes_hut_update_step(bodies, time_step);
+void barnes_hut(Scenario &bodies, double time_step, double total_time, TrajectoryWriter &trajectory, BarnesHutWorkspace &workspace,
+                TreeWalk walk, int output_every, double force_error_budget) {
+    LinearQuadtree tree;
+    InteractionList interactions;
+    if (force_error_budget > 0) {
+        double angle = tune_opening_angle(bodies, workspace, force_error_budget);
+        std::cout << "Opening angle " << angle << " keeps 99% of force errors within " << force_error_budget << "\n";
+    }
 
-        // Store positions, velocities, and forces for each body
-        all_positions.push_back(bodies.r);
-        all_velocities.push_back(bodies.v);
-        all_forces.push_back(bodies.f);
+    // Record positions, velocities, and forces for each body, and print them,
+    // on the pipeline's thread
+    OutputPipeline<Vector2D> output([&trajectory](const Snapshot<Vector2D> &state) {
+        ProfileScope profile(ProfilePhase::output);
+        trajectory.append(state.time, state.r, state.v, state.f);
+        std::cout << "Time: " << state.time << "\n";
+        for (size_t i = 0; i < state.r.size(); ++i) {
+            std::cout << "Body " << i + 1 << ": Position (" << state.r[i].x << ", " << state.r[i].y << "), Velocity (" << state.v[i].x << ", " << state.v[i].y << "), Force (" << state.f[i].x << ", " << state.f[i].y << ")\n";
+        }
+    }, output_every);
 
-        // Debug print positions, velocities, and forces
-        std::cout << "Time: " << t + time_step << std::endl;
-        for (size_t i = 0; i < bodies.r.size(); ++i) {
-            std::cout << "Body " << i + 1 << ": Position (" << bodies.r[i].x << ", " << bodies.r[i].y << "), Velocity (" << bodies.v[i].x << ", " << bodies.v[i].y << "), Force (" << bodies.f[i].x << ", " << bodies.f[i].y << ")\n";
+    size_t step = 0;
+    for (double t = 0; t < total_time; t += time_step) {
+        switch (walk) {
+            case TreeWalk::linear:
+                barnes_hut_update_step_linear(bodies, tree, time_step, workspace.leaf_capacity);
+                break;
+            case TreeWalk::linear_group:
+                barnes_hut_update_step_group(bodies, tree, interactions, time_step, 32, workspace.leaf_capacity);
+                break;
+            default:
+                barnes_hut_update_step(bodies, workspace, time_step);
+                break;
         }
+
+        ProfileScope profile(ProfilePhase::output);
+        output.publish(++step, t + time_step, bodies.r, bodies.v, bodies.f);
     }
+
+    output.finish();
+    std::cout << std::flush;
 }
 
 void barnes_hut_update_step(Scenario &bodies, double time_step) {
-    QuadNode *root = QuadNode::constructBarnesHutTree(&bodies);
+    BarnesHutWorkspace workspace;
+    barnes_hut_update_step(bodies, workspace, time_step);
+}
+
+// Refits the workspace's tree when it allows, else builds a new one.
+static QuadNode *build_or_refit(Scenario &bodies, BarnesHutWorkspace &workspace, double time_step) {
+    QuadNodeArena &arena = workspace.arena;
+    int leaf_capacity = std::max(1, workspace.leaf_capacity);
+    bool reusable = workspace.refit && workspace.root && workspace.tree_bodies == &bodies &&
+                    workspace.tree_size == bodies.r.size() && arena.leaf_capacity == leaf_capacity &&
+                    arena.max_depth == workspace.max_depth;
+    if (reusable) {
+        size_t max_migrants = static_cast<size_t>(workspace.refit_migration_limit * bodies.r.size());
+        bool refitted = QuadNode::refitBarnesHutTree(workspace.root, workspace.migrants, max_migrants);
+        if (refitted && arena.depth() <= workspace.built_depth + workspace.refit_depth_growth &&
+            arena.size() <= 2 * workspace.built_nodes && arena.slotCount() <= 2 * workspace.built_slots) {
+            workspace.refits++;
+            return workspace.root;
+        }
+    }
+
+    arena.leaf_capacity = leaf_capacity;
+    arena.max_depth = workspace.max_depth;
+    double margin = 0;
+    if (workspace.refit) {
+        double max_speed_sq = 0;
+        for (const Vector2D &v : bodies.v) max_speed_sq = std::max(max_speed_sq, v.norm2());
+        margin = workspace.refit_drift_steps * std::sqrt(max_speed_sq) * time_step;
+    }
+    workspace.root = QuadNode::constructBarnesHutTree(&bodies, arena, margin);
+    workspace.tree_bodies = &bodies;
+    workspace.tree_size = bodies.r.size();
+    workspace.built_nodes = arena.size();
+    workspace.built_slots = arena.slotCount();
+    workspace.built_depth = arena.depth();
+    workspace.builds++;
+    return workspace.root;
+}
+
+void barnes_hut_update_step(Scenario &bodies, BarnesHutWorkspace &workspace, double time_step) {
+    QuadNode *root;
+    {
+        ProfileScope profile(ProfilePhase::build);
+        root = build_or_refit(bodies, workspace, time_step);
+    }
+    std::vector<QuadNode *> &stack = workspace.stack;
 
     // Initialize forces to zero
     bodies.f.assign(bodies.r.size(), Vector2D{0.0, 0.0});
+    size_t interactions = 0;
+    ProfileScope force_profile(ProfilePhase::forces);
 
     /* Calculate the force exerted */
     for (size_t i = 0; i < bodies.r.size(); i++) {
@@ -72,33 +325,42 @@ void barnes_hut_update_step(Scenario &bodies, double time_step) {
                 bodies.f[i] += force;  // Store the force
                 bodies.v[i] += force * (time_step / m);
             }
+            interactions++;
         };
 
-        std::stack<QuadNode *> stack;
-        stack.push(root);
+        stack.clear();
+        stack.push_back(root);
         while (!stack.empty()) {
-            QuadNode *curr = stack.top();
-            stack.pop();
+            QuadNode *curr = stack.back();
+            stack.pop_back();
 
-            if (!curr->body_id.empty()) {
-                for (size_t curr_body : curr->body_id) {
-                    if (curr_body != i) {
-                        update_v(bodies.r[curr_body], bodies.m[curr_body]);
+            if (curr->isLeaf()) {
+                const int *ids = curr->bodyIds();
+                for (int k = 0; k < curr->num_bodies; k++) {
+                    if (static_cast<size_t>(ids[k]) != i) {
+                        update_v(bodies.r[ids[k]], bodies.m[ids[k]]);
                     }
                 }
-            } else if (curr->isFarEnough(bodies.r[i])) {
+            } else if (curr->isFarEnough(bodies.r[i], workspace.opening_angle)) {
                 update_v(curr->center_of_mass, curr->m);
+                if (workspace.use_quadrupole) {
+                    Vector2D force = curr->quadrupoleAcceleration(r) * m;
+                    bodies.f[i] += force;
+                    bodies.v[i] += force * (time_step / m);
+                }
             } else {
                 for (int j = 0; j < 4; j++) {
-                    if (curr->children[j]) stack.push(curr->children[j]);
+                    if (curr->children[j]) stack.push_back(curr->children[j]);
                 }
             }
         }
     }
+    workspace.interactions = interactions;
+    force_profile.end();
 
     /* Update positions */
+    ProfileScope profile(ProfilePhase::integrate);
     for (size_t i = 0; i < bodies.r.size(); i++) {
         bodies.r[i] += bodies.v[i] * time_step;
     }
-    delete root;
 }
@@ -2,60 +2,97 @@
 #define BARNES_HUT_HPP
 
 #include "nbody_simulation2.hpp"
+#include <algorithm>
 #include <cmath>
-#include <stack>
+#include <new>
 #include <vector>
 
 const double theta = 0.5; // Threshold for the approximation
 const double G = 6.67430e-11; // Gravitational constant
 
+class QuadNodeArena;
+
 class QuadNode {
     enum quad { nw, ne, sw, se };  // indeed this is not used
     bool is_empty = true;
     const Vector2D center;  // center and dimension should be const, right?
     const Vector2D dimension;
+    const int depth;
     Scenario *const scenario;
+    QuadNodeArena *const arena;
 
 public:
     QuadNode *children[4]{nullptr, nullptr, nullptr, nullptr};
     double m = 0;
     Vector2D center_of_mass;
-    std::vector<int> body_id;
+    // Bodies held by a leaf live in the arena's body slots, starting at
+    // first_slot; internal nodes have num_bodies == 0
+    int first_slot = -1;
+    int num_bodies = 0;
+    // Second moments sum m (r - center_of_mass)_i (r - center_of_mass)_j,
+    // filled by computeQuadrupole() once all bodies are in
+    double quad_xx = 0, quad_xy = 0, quad_yy = 0;
 
     // This is the main entry point of the Barnes-Hut tree. This constructs a
     // Barnes-Hut tree from `bodies`.
-    // NOTE:: Remember to delete the result.
-    static QuadNode *constructBarnesHutTree(Scenario *bodies) {
-        QuadNode *root =
-            new QuadNode(bodies, Vector2D{500.0, 500.0},
-                         Vector2D{1000.0, 1000.0});
-
-        for (size_t i = 0; i < bodies->r.size(); i++) {
-            root->addBody(i);
-        }
-
-        return root;
-    }
-
-    QuadNode(Scenario *const bodies, const Vector2D &center, const Vector2D &dimension)
+    // NOTE:: The nodes belong to `arena` and stay valid until its next reset().
+    // The root cell is the bodies' bounding square, widened by margin on each
+    // side.
+    static QuadNode *constructBarnesHutTree(Scenario *bodies, QuadNodeArena &arena, double margin = 0);
+
+    // Updates a tree from constructBarnesHutTree() to the bodies' new
+    // positions instead of building a new one: the bodies that left their
+    // leaf are taken out and inserted again from the root, emptied cells are
+    // dropped, cells left with no more than leaf_capacity bodies become leaves
+    // again, and masses, centers of mass and quadrupoles are recomputed
+    // bottom-up. The moved bodies are left in migrants. Returns false if a
+    // body is outside the root cell (the tree is then untouched) or more than
+    // max_migrants bodies moved (the tree is then incomplete); either way it
+    // must be rebuilt.
+    static bool refitBarnesHutTree(QuadNode *root, std::vector<int> &migrants, size_t max_migrants);
+
+    QuadNode(Scenario *const bodies, QuadNodeArena *const arena, const Vector2D &center, const Vector2D &dimension, int depth)
         : center(center),
           dimension(dimension),
+          depth(depth),
           scenario(bodies),
+          arena(arena),
           center_of_mass(center) {}
 
-    ~QuadNode() {
-        for (int i = 0; i < 4; i++) delete children[i];
-    }
+    bool isLeaf() const { return num_bodies > 0; }
+    inline const int *bodyIds() const;
 
-    bool isFarEnough(const Vector2D &point) const {
+    bool isFarEnough(const Vector2D &point, double opening_angle = theta) const {
         Vector2D dr = center_of_mass - point;
         double dist_sq = std::max(dr.norm2(), 1e-6);
-        return dimension.x * dimension.x / dist_sq < theta * theta;
+        return dimension.x * dimension.x / dist_sq < opening_angle * opening_angle;
     }
 
     void addBody(int index);
 
+    // Upward pass combining the children's second moments (parallel axis
+    // theorem). Needs the final centers of mass, so it runs after insertion.
+    void computeQuadrupole();
+
+    // Acceleration at `point` from the quadrupole term of this cell's
+    // expansion; add it to the monopole term for the far-field force.
+    Vector2D quadrupoleAcceleration(const Vector2D &point) const {
+        Vector2D R = point - center_of_mass;
+        double dist_sq = std::max(R.norm2(), 1e-6);
+        double inv_r5 = 1.0 / (dist_sq * dist_sq * std::sqrt(dist_sq));
+        Vector2D SR{quad_xx * R.x + quad_xy * R.y, quad_xy * R.x + quad_yy * R.y};
+        double RSR = R.x * SR.x + R.y * SR.y;
+        double trace = quad_xx + quad_yy;
+        return (SR * 3.0 + R * (1.5 * trace - 7.5 * RSR / dist_sq)) * (G * inv_r5);
+    }
+
 private:
+    void storeBody(int index);
+    void removeMigrants(std::vector<int> &migrants);
+    int refit();
+    // Second moments of this cell from its bodies and its children's moments
+    void combineQuadrupole();
+
     quad getQuad(const Vector2D &r) const {
         return r.x < center.x ? (r.y < center.y ? sw : nw)
                               : (r.y < center.y ? se : ne);
@@ -91,7 +128,119 @@ private:
     }
 };
 
+// Storage for the nodes of one tree. Nodes are carved out of fixed-size blocks
+// that are kept across steps: reset() recycles them without touching the heap.
+// The arena also holds the body ids of the leaves and the tree's shape limits.
+class QuadNodeArena {
+public:
+    static const size_t block_size = 4096;
+
+    // A leaf splits once it would exceed leaf_capacity bodies, unless it is
+    // already max_depth levels deep (then it keeps growing, so coincident
+    // bodies cannot recurse forever).
+    int leaf_capacity = 1;
+    int max_depth = 48;
+
+    QuadNodeArena() {}
+    QuadNodeArena(const QuadNodeArena &) = delete;
+    QuadNodeArena &operator=(const QuadNodeArena &) = delete;
+    ~QuadNodeArena();
+
+    QuadNode *create(Scenario *bodies, const Vector2D &center, const Vector2D &dimension, int depth) {
+        if (used == blocks.size() * block_size) grow();
+        QuadNode *slot = blocks[used / block_size] + used % block_size;
+        used++;
+        deepest = std::max(deepest, depth);
+        return new (slot) QuadNode(bodies, this, center, dimension, depth);
+    }
+
+    // Reserves `count` consecutive body slots and returns the first one
+    int allocateSlots(int count);
+    int *slots() { return body_slots.data(); }
+    const int *slots() const { return body_slots.data(); }
+
+    void reset() {
+        used = 0;
+        deepest = 0;
+        body_slots.clear();
+    }
+    size_t size() const { return used; }
+    size_t slotCount() const { return body_slots.size(); }
+    // Depth of the deepest node created since the last reset()
+    int depth() const { return deepest; }
+
+private:
+    void grow();
+
+    std::vector<QuadNode *> blocks;
+    size_t used = 0;
+    int deepest = 0;
+    std::vector<int> body_slots;
+};
+
+inline const int *QuadNode::bodyIds() const {
+    return arena->slots() + first_slot;
+}
+
+// Everything a Barnes-Hut step needs besides the bodies, kept alive between
+// steps so the steady-state loop does not allocate.
+struct BarnesHutWorkspace {
+    QuadNodeArena arena;
+    std::vector<QuadNode *> stack;
+
+    // With quadrupole corrections in the far field, an opening angle of 0.7
+    // keeps the 99th percentile force error below the monopole walk's at 0.5
+    // (see check_force_accuracy in test_barnes_hut.cpp).
+    double opening_angle = theta;
+    bool use_quadrupole = false;
+
+    // Bodies per leaf before it splits, and the depth at which splitting
+    // stops; see QuadNodeArena
+    int leaf_capacity = 1;
+    int max_depth = 48;
+
+    // Refit the previous step's tree to the moved bodies instead of building
+    // a new one (see QuadNode::refitBarnesHutTree). Its root cell leaves room
+    // for the fastest body to drift refit_drift_steps steps. The tree is still
+    // rebuilt when a body leaves the root cell, when more than
+    // refit_migration_limit of the bodies changed leaf in one step, or once
+    // refits have made it refit_depth_growth levels deeper, or twice as large
+    // in nodes or body slots, than when it was built.
+    bool refit = false;
+    int refit_drift_steps = 4;
+    double refit_migration_limit = 0.25;
+    int refit_depth_growth = 2;
+
+    // Body-body and body-node interactions computed by the last step
+    size_t interactions = 0;
+    // Trees built from scratch and refitted so far
+    size_t builds = 0;
+    size_t refits = 0;
+
+    // The tree kept for refitting, the bodies it holds and its shape when built
+    QuadNode *root = nullptr;
+    const Scenario *tree_bodies = nullptr;
+    size_t tree_size = 0;
+    size_t built_nodes = 0;
+    size_t built_slots = 0;
+    int built_depth = 0;
+    std::vector<int> migrants;
+};
+
+void barnes_hut_update_step(Scenario &bodies, BarnesHutWorkspace &workspace, double time_step);
 void barnes_hut_update_step(Scenario &bodies, double time_step);
-void barnes_hut(Scenario &bodies, double time_step, double total_time, std::vector<std::vector<Vector2D>> &all_positions, std::vector<std::vector<Vector2D>> &all_velocities, std::vector<std::vector<Vector2D>> &all_forces);
+// Tree and traversal used by each step of barnes_hut(): the pointer-based
+// QuadNode tree, the Morton-ordered LinearQuadtree walked body by body, or the
+// LinearQuadtree walked once per group of nearby bodies.
+enum class TreeWalk { pointer, linear, linear_group };
+
+// The pointer walk steps with the settings in workspace: opening angle,
+// quadrupole far field, leaf capacity and refitting; the linear walks take
+// only its leaf capacity and use theta with monopoles. Only every
+// output_every-th step is recorded and printed. With a positive
+// force_error_budget the pointer walk first picks the largest opening angle
+// keeping 99% of sampled forces within that relative error (see accuracy.hpp).
+void barnes_hut(Scenario &bodies, double time_step, double total_time, TrajectoryWriter &trajectory, BarnesHutWorkspace &workspace,
+                TreeWalk walk = TreeWalk::pointer, int output_every = 1, double force_error_budget = 0);
 
 #endif // BARNES_HUT_HPP
@@ -1,74 +1,230 @@
 #include "barnes_hut_multi.hpp"
+#include "bounding_box.hpp"
+#include "log.hpp"
+#include "output_pipeline.hpp"
+#include "perf_counters.hpp"
+#include "trace.hpp"
+#include <chrono>
 #include <iostream>
 #include <cmath>
 #include <vector>
-#include <stack>
-#include <thread>
+#include <atomic>
+#include <algorithm>
 
-const double theta = 0.5; // Threshold for the approximation
 const double G = 6.67430e-11; // Gravitational constant
+const int force_chunk_size = 64; // Bodies per work-stealing chunk in the force walk
+
+
+void QuadNode::reset(Scenario *bodies, const BarnesHutSettings *settings, const Vector2D &center, const Vector2D &dimension, int depth) {
+    is_empty = true;
+    this->center = center;
+    this->dimension = dimension;
+    this->depth = depth;
+    scenario = bodies;
+    this->settings = settings;
+    for (int q = 0; q < 4; ++q) children[q] = nullptr;
+    m = 0;
+    center_of_mass = center;
+    slot_arena = nullptr;
+    first_slot = -1;
+    num_bodies = 0;
+}
 
-const double canvas_width = 1000.0;
-const double canvas_height = 1000.0;
-const double universe_width = 1000.0;
-const double universe_height = 1000.0;
-
-
-QuadNode::QuadNode(Scenario *const bodies, const Vector2D &center, const Vector2D &dimension)
-    : center(center), dimension(dimension), scenario(bodies), center_of_mass(center) {}
-
-QuadNode::~QuadNode() {
-    for (int i = 0; i < 4; i++) delete children[i];
+// Appends a body to this leaf's slots, in the arena of the thread filling it.
+// Leaves below max_depth never exceed leaf_capacity; deeper ones double their
+// slot block whenever it fills up.
+void QuadNode::storeBody(int index, QuadNodeArena &arena) {
+    int capacity = settings->leaf_capacity;
+    while (capacity < num_bodies) capacity *= 2;
+    if (num_bodies == 0) {
+        slot_arena = &arena;
+        first_slot = arena.allocateSlots(capacity);
+    } else if (num_bodies == capacity) {
+        int first = arena.allocateSlots(2 * capacity);
+        std::copy(arena.slots() + first_slot, arena.slots() + first_slot + num_bodies, arena.slots() + first);
+        first_slot = first;
+    }
+    arena.slots()[first_slot + num_bodies++] = index;
 }
 
-void QuadNode::addBody(int index) {
+void QuadNode::addBody(int index, QuadNodeArena &arena) {
     if (!isInside(scenario->r[index])) return;
 
     if (is_empty) {
-        body_id.push_back(index);
+        storeBody(index, arena);
         updateCenterOfMass(index);
         is_empty = false;
         return;
     }
 
-    if (body_id.size() == 1) {
-        int existing_body = body_id[0];
-        body_id.clear();
+    if (num_bodies > 0) {
+        if (num_bodies < settings->leaf_capacity || depth >= settings->max_depth) {
+            storeBody(index, arena);
+            updateCenterOfMass(index);
+            return;
+        }
 
-        quad q = getQuad(scenario->r[existing_body]);
-        if (!children[q]) {
-            children[q] = new QuadNode(scenario, getQuadCenter(q), dimension / 2);
+        // The children take their slots from the same arena, which may move
+        // them, so the bodies are read by position
+        int moved = num_bodies;
+        num_bodies = 0;
+        for (int k = 0; k < moved; ++k) {
+            int existing_body = arena.slots()[first_slot + k];
+            quad q = getQuad(scenario->r[existing_body]);
+            if (!children[q]) {
+                children[q] = arena.create(scenario, settings, getQuadCenter(q), dimension / 2, depth + 1);
+            }
+            children[q]->addBody(existing_body, arena);
         }
-        children[q]->addBody(existing_body);
     }
 
     quad q = getQuad(scenario->r[index]);
     if (!children[q]) {
-        children[q] = new QuadNode(scenario, getQuadCenter(q), dimension / 2);
+        children[q] = arena.create(scenario, settings, getQuadCenter(q), dimension / 2, depth + 1);
     }
-    children[q]->addBody(index);
+    children[q]->addBody(index, arena);
 
     updateCenterOfMass(index);
 }
 
 
-QuadNode* QuadNode::constructBarnesHutTree(Scenario *bodies) {
-    std::cout << "Initializing root node.\n";
-    QuadNode *root = new QuadNode(bodies, Vector2D(canvas_width / 2., canvas_height / 2.), Vector2D(universe_width, universe_height));
+QuadNode* QuadNode::constructBarnesHutTree(Scenario *bodies, ThreadPool &pool, const BarnesHutSettings &settings,
+                                           BarnesHutMultiWorkspace &workspace) {
+    LOG_DEBUG("Initializing root node.");
+    TraceScope trace("build");
+    ProfileScope profile(ProfilePhase::build);
+    // The previous tree is dropped here; its nodes are handed out again
+    workspace.threads.resize(pool.size());
+    for (BarnesHutThreadStorage &storage : workspace.threads) storage.arena.reset();
+    QuadNodeArena &arena = workspace.threads[0].arena;
+
+    BoundingSquare<Vector2D> box = bounding_square(bodies->r, pool);
+    QuadNode *root = arena.create(bodies, &settings, box.center, Vector2D(box.size, box.size), 0);
+
+    // The top `levels` of the tree are laid out up front; each of the resulting
+    // cells is then an independent subtree that one thread fills on its own.
+    int levels = 1;
+    while (levels < 5 && (1 << (2 * levels)) < 8 * pool.size()) levels++;
+    std::vector<QuadNode *> &cells = workspace.cells;
+    cells.clear();
+    root->split(levels, cells, arena);
+    int num_cells = cells.size();
+    int num_bodies = bodies->r.size();
+
+    // Bucket the bodies by cell, keeping index order inside each cell
+    std::vector<int> &cell_of = workspace.cell_of;
+    std::vector<std::vector<int>> &counts = workspace.counts;
+    std::vector<int> &cell_start = workspace.cell_start;
+    std::vector<int> &sorted = workspace.sorted;
+    cell_of.resize(num_bodies);
+    counts.resize(pool.size());
+    for (std::vector<int> &count : counts) count.assign(num_cells + 1, 0);
+    cell_start.assign(num_cells + 1, 0);
+    sorted.resize(num_bodies);
+    int chunk_size = (num_bodies + pool.size() - 1) / pool.size();
+    pool.run([&](int thread_id) {
+        TraceScope trace("bucket bodies");
+        ProfileScope profile(ProfilePhase::build);
+        int start = std::min(thread_id * chunk_size, num_bodies);
+        int end = std::min(start + chunk_size, num_bodies);
+        std::vector<int> &count = counts[thread_id];
+        for (int i = start; i < end; ++i) {
+            cell_of[i] = root->cellIndex(bodies->r[i], levels);
+            count[cell_of[i]]++;
+        }
+        pool.barrier();
+
+        if (thread_id == 0) {
+            int offset = 0;
+            for (int c = 0; c < num_cells; ++c) {
+                cell_start[c] = offset;
+                for (auto &thread_count : counts) {
+                    int here = thread_count[c];
+                    thread_count[c] = offset;
+                    offset += here;
+                }
+            }
+            cell_start[num_cells] = offset;
+        }
+        pool.barrier();
+
+        for (int i = start; i < end; ++i) {
+            sorted[count[cell_of[i]]++] = i;
+        }
+    });
+
+    // Build the subtrees concurrently, handing cells out one at a time; each
+    // thread takes the nodes of its subtrees from its own arena
+    std::atomic<int> next_cell(0);
+    pool.run([&](int thread_id) {
+        QuadNodeArena &thread_arena = workspace.threads[thread_id].arena;
+        for (int c = next_cell++; c < num_cells; c = next_cell++) {
+            TraceScope trace("subtree", c);
+            ProfileScope profile(ProfilePhase::build);
+            for (int k = cell_start[c]; k < cell_start[c + 1]; ++k) {
+                cells[c]->addBody(sorted[k], thread_arena);
+            }
+        }
+    });
 
-    for (size_t i = 0; i < bodies->r.size(); i++) {
-        std::cout << "Adding body " << i << "\n";
-        root->addBody(i);
+    {
+        TraceScope trace("merge moments");
+        root->mergeSplitMoments(levels);
     }
 
-    std::cout << "Tree construction complete.\n";
+    LOG_DEBUG("Tree construction complete.");
     return root;
 }
 
+void QuadNode::split(int levels, std::vector<QuadNode *> &cells, QuadNodeArena &arena) {
+    if (levels == 0) {
+        cells.push_back(this);
+        return;
+    }
+    for (int q = 0; q < 4; ++q) {
+        children[q] = arena.create(scenario, settings, getQuadCenter(quad(q)), dimension / 2, depth + 1);
+        children[q]->split(levels - 1, cells, arena);
+    }
+}
+
+// Index in the `cells` list filled by split() of the cell holding r. Follows
+// getQuad() level by level so it agrees exactly with serial insertion.
+int QuadNode::cellIndex(const Vector2D &r, int levels) const {
+    const QuadNode *node = this;
+    int index = 0;
+    for (int level = 0; level < levels; ++level) {
+        quad q = node->getQuad(r);
+        index = 4 * index + q;
+        node = node->children[q];
+    }
+    return index;
+}
+
+// Fills in mass and center of mass of the nodes laid out by split(), from the
+// subtrees below them, and unlinks the cells that received no body.
+void QuadNode::mergeSplitMoments(int levels) {
+    if (levels == 0) return;
+    Vector2D weighted(0, 0);
+    m = 0;
+    for (int q = 0; q < 4; ++q) {
+        children[q]->mergeSplitMoments(levels - 1);
+        if (children[q]->m == 0) {
+            children[q] = nullptr;
+            continue;
+        }
+        m += children[q]->m;
+        weighted += children[q]->center_of_mass * children[q]->m;
+    }
+    if (m > 0) {
+        center_of_mass = weighted / m;
+        is_empty = false;
+    }
+}
+
 bool QuadNode::isFarEnough(const Vector2D &point) const {
     Vector2D dr = center_of_mass - point;
     double dist_sq = std::max(dr.norm2(), 1e-6);
-    return dimension.x * dimension.x / dist_sq < theta * theta;
+    return dimension.x * dimension.x / dist_sq < settings->opening_angle * settings->opening_angle;
 }
 
 QuadNode::quad QuadNode::getQuad(const Vector2D &r) const {
@@ -101,18 +257,24 @@ bool QuadNode::isInside(const Vector2D &point) const {
            point.y <= center.y + dimension.y / 2 && point.y >= center.y - dimension.y / 2;
 }
 
-void barnes_hut_update_step_aux(int start, int end, Scenario &bodies, QuadNode *root, double time_step) {
-    std::cout << "Auxiliary update step for range " << start << " to " << end << std::endl;
+void barnes_hut_update_step_aux(int start, int end, Scenario &bodies, QuadNode *root, double time_step, WalkCounters &counters,
+                                std::vector<QuadNode *> &stack) {
+    LOG_TRACE("Auxiliary update step for range " << start << " to " << end);
+    TraceScope trace("walk chunk", start);
+    ProfileScope profile(ProfilePhase::forces);
+    // Counted in locals and added to the thread's slot once per chunk
+    WalkCounters local;
     for (int i = start; i < end; ++i) {
         if (i >= bodies.m.size() || i >= bodies.r.size() || i >= bodies.v.size() || i >= bodies.f.size()) {
-            std::cerr << "Error: Out of bounds access during force calculation\n";
+            LOG_ERROR("Out of bounds access during force calculation");
+            counters.add(local);
             return;
         }
 
         const double m = bodies.m[i];
         const Vector2D &r = bodies.r[i];
 
-        std::cout << "Updating body " << i << " at position (" << r.x << ", " << r.y << ")\n";
+        LOG_TRACE("Updating body " << i << " at position (" << r.x << ", " << r.y << ")");
 
         auto update_v = [&](const Vector2D &other_r, const double other_m) {
             Vector2D dr = other_r - r;
@@ -124,101 +286,136 @@ void barnes_hut_update_step_aux(int start, int end, Scenario &bodies, QuadNode *
             bodies.f[i] += force;  // Update forces
         };
 
-        std::stack<QuadNode *> stack;
-        stack.push(root);
+        stack.clear();
+        stack.push_back(root);
         while (!stack.empty()) {
-            QuadNode *curr = stack.top();
-            stack.pop();
-
-            if (!curr->body_id.empty()) {
-                for (int curr_body : curr->body_id) {
+            QuadNode *curr = stack.back();
+            stack.pop_back();
+            local.node_visits++;
+
+            if (curr->num_bodies > 0) {
+                local.max_depth = std::max(local.max_depth, curr->depth);
+                const int *ids = curr->bodyIds();
+                for (int k = 0; k < curr->num_bodies; ++k) {
+                    int curr_body = ids[k];
                     if (curr_body != i) {
                         if (curr_body >= bodies.r.size() || curr_body >= bodies.m.size()) {
-                            std::cerr << "Error: Out of bounds access during stack processing\n";
+                            LOG_ERROR("Out of bounds access during stack processing");
+                            counters.add(local);
                             return;
                         }
                         update_v(bodies.r[curr_body], bodies.m[curr_body]);
+                        local.body_body++;
                     }
                 }
             } else if (curr->isFarEnough(bodies.r[i])) {
                 update_v(curr->center_of_mass, curr->m);
+                local.body_cell++;
             } else {
                 for (int j = 0; j < 4; ++j) {
-                    if (curr->children[j]) stack.push(curr->children[j]);
+                    if (curr->children[j]) stack.push_back(curr->children[j]);
                 }
             }
         }
     }
-    std::cout << "Auxiliary update step complete for range " << start << " to " << end << std::endl;
+    counters.add(local);
+    LOG_TRACE("Auxiliary update step complete for range " << start << " to " << end);
 }
 
 
-void barnes_hut_update_step_multi(Scenario &bodies, int num_threads, double time_step) {
-    std::cout << "Constructing Barnes-Hut tree...\n";
-    QuadNode *root = QuadNode::constructBarnesHutTree(&bodies);
-    if (root == nullptr) {
-        std::cerr << "Error: root is null" << std::endl;
-        return;
-    }
-    std::cout << "Tree constructed.\n";
-
-    std::vector<std::thread> threads;
-    int num_bodies = bodies.r.size();
-    int num_bodies_per_thread = num_bodies / num_threads;
+size_t barnes_hut_update_step_multi(Scenario &bodies, ThreadPool &pool, BarnesHutMultiWorkspace &workspace, double time_step,
+                                    const BarnesHutSettings &settings, Metrics *metrics) {
+    Metrics scratch(metrics ? 1 : pool.size());
+    Metrics &step = metrics ? *metrics : scratch;
+    step.beginStep();
+    TraceScope trace("step");
 
-    for (int i = 0; i < num_threads - 1; ++i) {
-        std::cout << "Starting thread " << i << "\n";
-        threads.emplace_back(barnes_hut_update_step_aux, i * num_bodies_per_thread, (i + 1) * num_bodies_per_thread, std::ref(bodies), root, time_step);
+    LOG_DEBUG("Constructing Barnes-Hut tree...");
+    auto phase_start = std::chrono::steady_clock::now();
+    QuadNode *root = QuadNode::constructBarnesHutTree(&bodies, pool, settings, workspace);
+    if (root == nullptr) {
+        LOG_ERROR("root is null");
+        return 0;
     }
-    std::cout << "Main thread handling remaining bodies.\n";
-    barnes_hut_update_step_aux((num_threads - 1) * num_bodies_per_thread, num_bodies, bodies, root, time_step);
-
-    for (auto &thread : threads) {
-        thread.join();
+    step.current().build_seconds = seconds_since(phase_start);
+    LOG_DEBUG("Tree constructed.");
+
+    bodies.f.assign(bodies.r.size(), Vector2D(0, 0));
+
+    // Walk cost differs a lot between bodies in dense and sparse regions, so
+    // bodies go out in small chunks that idle threads can steal
+    phase_start = std::chrono::steady_clock::now();
+    {
+        TraceScope trace("walk");
+        ProfileScope profile(ProfilePhase::forces);
+        pool.parallel_for_stealing(0, bodies.r.size(), force_chunk_size, [&](int start, int end, int thread_id) {
+            barnes_hut_update_step_aux(start, end, bodies, root, time_step, step.thread(thread_id), workspace.threads[thread_id].stack);
+        });
     }
-
-    std::cout << "Updating positions.\n";
-    for (size_t i = 0; i < bodies.r.size(); ++i) {
-        if (i >= bodies.v.size()) {
-            std::cerr << "Error: Out of bounds access during position update\n";
-            return;
+    step.current().walk_seconds = seconds_since(phase_start);
+
+    LOG_DEBUG("Updating positions.");
+    phase_start = std::chrono::steady_clock::now();
+    {
+        TraceScope trace("integrate");
+        ProfileScope profile(ProfilePhase::integrate);
+        for (size_t i = 0; i < bodies.r.size(); ++i) {
+            if (i >= bodies.v.size()) {
+                LOG_ERROR("Out of bounds access during position update");
+                return 0;
+            }
+            bodies.r[i] += bodies.v[i] * time_step;
         }
-        bodies.r[i] += bodies.v[i] * time_step;
     }
+    step.current().integrate_seconds = seconds_since(phase_start);
 
-    delete root;
-    std::cout << "Update complete.\n";
-}
+    LOG_DEBUG("Update complete.");
 
+    return step.endStep().interactions();
+}
 
+size_t barnes_hut_update_step_multi(Scenario &bodies, ThreadPool &pool, double time_step, const BarnesHutSettings &settings, Metrics *metrics) {
+    BarnesHutMultiWorkspace workspace;
+    return barnes_hut_update_step_multi(bodies, pool, workspace, time_step, settings, metrics);
+}
 
-void barnes_hut(Scenario &bodies, double time_step, double total_time, 
-                std::vector<std::vector<Vector2D>> &all_positions, 
-                std::vector<std::vector<Vector2D>> &all_velocities, 
-                std::vector<std::vector<Vector2D>> &all_forces, int num_threads) {
 
-    std::cout << "Starting barnes_hut function...\n";
 
+void barnes_hut(Scenario &bodies, double time_step, double total_time, 
+                TrajectoryWriter &trajectory, int num_threads, int output_every, const BarnesHutSettings &settings) {
+
+    LOG_INFO("Starting barnes_hut function...");
+    ThreadPool pool(num_threads);
+    BarnesHutMultiWorkspace workspace;
+    Metrics metrics(pool.size());
+    OutputPipeline<Vector2D> output([&trajectory](const Snapshot<Vector2D> &state) {
+        TraceScope trace("write trajectory", state.step);
+        ProfileScope profile(ProfilePhase::output);
+        trajectory.append(state.time, state.r, state.v, state.f);
+    }, output_every);
+
+    size_t step = 0;
     for (double t = 0; t < total_time; t += time_step) {
-        std::cout << "Time: " << t << "\n";
-        
-        std::cout << "Calling barnes_hut_update_step_multi...\n";
-        barnes_hut_update_step_multi(bodies, num_threads, time_step);
-        
-        std::cout << "barnes_hut_update_step_multi completed.\n";
+        LOG_DEBUG("Time: " << t);
+        barnes_hut_update_step_multi(bodies, pool, workspace, time_step, settings, &metrics);
 
         // Capture the current state of the system
         if (bodies.r.size() != bodies.v.size() || bodies.r.size() != bodies.f.size()) {
-            std::cerr << "Error: Mismatch in sizes of positions, velocities, and forces in barnes_hut\n";
+            LOG_ERROR("Mismatch in sizes of positions, velocities, and forces in barnes_hut");
             return;
         }
 
-        all_positions.push_back(bodies.r);
-        all_velocities.push_back(bodies.v);
-        all_forces.push_back(bodies.f);
-
-        std::cout << "State captured for time: " << t << "\n";
+        {
+            TraceScope trace("publish output");
+            ProfileScope profile(ProfilePhase::output);
+            output.publish(++step, t + time_step, bodies.r, bodies.v, bodies.f);
+        }
+        LOG_DEBUG("State captured for time: " << t);
     }
 
-    std::cout << "barnes_hut function complete.\n";
+    output.finish();
+    LOG_INFO("barnes_hut function complete.");
+    if (NBODY_LOG_LEVEL >= NBODY_LOG_LEVEL_INFO) {
+        metrics.dump(std::cout, NBODY_LOG_LEVEL >= NBODY_LOG_LEVEL_DEBUG);
+    }
 }
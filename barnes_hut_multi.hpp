@@ -1,40 +1,149 @@
 #ifndef BARNES_HUT_MULTI_HPP
 #define BARNES_HUT_MULTI_HPP
 
+#include "aligned_allocator.hpp"
+#include "metrics.hpp"
 #include "nbody_simulation_bhmulti.hpp"
+#include "thread_pool.hpp"
 #include <cmath>
-#include <stack>
+#include <memory>
 #include <vector>
 
+// Shape of the tree and opening angle of the walk. A leaf splits once it
+// would exceed leaf_capacity bodies, unless it is already max_depth levels
+// deep (then it keeps growing, so coincident bodies cannot recurse forever).
+struct BarnesHutSettings {
+    double opening_angle = 0.5;
+    int leaf_capacity = 1;
+    int max_depth = 48;
+};
+
+class QuadNodeArena;
+struct BarnesHutMultiWorkspace;
+
 class QuadNode {
 public:
     enum quad { nw, ne, sw, se };
     bool is_empty = true;
-    const Vector2D center;
-    const Vector2D dimension;
-    Scenario *const scenario;
+    Vector2D center;
+    Vector2D dimension;
+    int depth = 0;
+    Scenario *scenario = nullptr;
+    const BarnesHutSettings *settings = nullptr;
 
     QuadNode *children[4]{nullptr, nullptr, nullptr, nullptr};
     double m = 0;
     Vector2D center_of_mass;
-    std::vector<int> body_id;
+    // Bodies held by a leaf live in the body slots of the arena of the thread
+    // that filled it, starting at first_slot; internal nodes have none
+    QuadNodeArena *slot_arena = nullptr;
+    int first_slot = -1;
+    int num_bodies = 0;
 
-    static QuadNode *constructBarnesHutTree(Scenario *bodies);
-    QuadNode(Scenario *const bodies, const Vector2D &center, const Vector2D &dimension);
-    ~QuadNode();
+    // Root cell is the bounding square of the bodies, found by a parallel
+    // min/max reduction on `pool`. The nodes come from the workspace's arenas
+    // and live until its next build; they keep a pointer to settings, which
+    // must outlive the tree.
+    static QuadNode *constructBarnesHutTree(Scenario *bodies, ThreadPool &pool, const BarnesHutSettings &settings,
+                                            BarnesHutMultiWorkspace &workspace);
+    // Makes the node an empty cell
+    void reset(Scenario *bodies, const BarnesHutSettings *settings, const Vector2D &center, const Vector2D &dimension, int depth);
 
     bool isFarEnough(const Vector2D &point) const;
-    void addBody(int index);  // Ensure this declaration is here
+    // New children come from arena, the one of the thread adding the body
+    void addBody(int index, QuadNodeArena &arena);
+    const int *bodyIds() const;
 
 private:
+    void storeBody(int index, QuadNodeArena &arena);
     quad getQuad(const Vector2D &r) const;
     void updateCenterOfMass(size_t id);
     Vector2D getQuadCenter(quad q) const;
     bool isInside(const Vector2D &point) const;
+
+    // Helpers for the parallel build in constructBarnesHutTree
+    void split(int levels, std::vector<QuadNode *> &cells, QuadNodeArena &arena);
+    int cellIndex(const Vector2D &r, int levels) const;
+    void mergeSplitMoments(int levels);
+};
+
+// Nodes and leaf body slots built by one thread, kept across steps: reset()
+// hands the same nodes and slots out again, so once the tree has stopped
+// growing a build does not touch the heap. Nodes come in fixed blocks, which
+// never move, so the ones handed out stay valid while the arena grows.
+class QuadNodeArena {
+public:
+    static const size_t block_size = 4096;
+
+    QuadNode *create(Scenario *bodies, const BarnesHutSettings *settings, const Vector2D &center, const Vector2D &dimension, int depth) {
+        if (used == blocks.size() * block_size) blocks.emplace_back(new QuadNode[block_size]);
+        QuadNode *node = &blocks[used / block_size][used % block_size];
+        used++;
+        node->reset(bodies, settings, center, dimension, depth);
+        return node;
+    }
+
+    // Reserves `count` consecutive body slots and returns the first one
+    int allocateSlots(int count) {
+        int first = body_slots.size();
+        body_slots.resize(body_slots.size() + count);
+        return first;
+    }
+    int *slots() { return body_slots.data(); }
+    const int *slots() const { return body_slots.data(); }
+
+    void reset() {
+        used = 0;
+        body_slots.clear();
+    }
+    size_t size() const { return used; }
+
+private:
+    std::vector<std::unique_ptr<QuadNode[]>> blocks;
+    size_t used = 0;
+    std::vector<int> body_slots;
+};
+
+inline const int *QuadNode::bodyIds() const {
+    return slot_arena->slots() + first_slot;
+}
+
+// What one pool thread keeps between steps: the arena of the subtrees it
+// builds and its stack for the force walk. Padded to a cache line, as both
+// change on every node the thread touches.
+struct alignas(64) BarnesHutThreadStorage {
+    QuadNodeArena arena;
+    std::vector<QuadNode *> stack;
+};
+
+// Everything barnes_hut_update_step_multi needs besides the bodies, kept
+// between steps like the sequential engine's BarnesHutWorkspace, so that a
+// steady-state step allocates neither per node nor per body.
+struct BarnesHutMultiWorkspace {
+    std::vector<BarnesHutThreadStorage, AlignedAllocator<BarnesHutThreadStorage, alignof(BarnesHutThreadStorage)>> threads;
+
+    // Bucketing of the bodies by top-level cell in constructBarnesHutTree
+    std::vector<QuadNode *> cells;
+    std::vector<int> cell_of;
+    std::vector<std::vector<int>> counts;
+    std::vector<int> cell_start;
+    std::vector<int> sorted;
 };
 
-void barnes_hut_update_step_multi(Scenario &bodies, int num_threads, double time_step);
-void barnes_hut_update_step_aux(int start, int end, Scenario &bodies, QuadNode *root, double time_step);
-void barnes_hut(Scenario &bodies, double time_step, double total_time, std::vector<std::vector<Vector2D>> &all_positions, std::vector<std::vector<Vector2D>> &all_velocities, std::vector<std::vector<Vector2D>> &all_forces, int num_threads);
+// Returns the number of body-body and body-node interactions computed. If
+// metrics is given (sized for the pool), the step's phase times and walk
+// counters are recorded in it.
+size_t barnes_hut_update_step_multi(Scenario &bodies, ThreadPool &pool, BarnesHutMultiWorkspace &workspace, double time_step,
+                                    const BarnesHutSettings &settings = BarnesHutSettings(), Metrics *metrics = nullptr);
+// The same with a workspace of its own, which allocates the whole tree again
+size_t barnes_hut_update_step_multi(Scenario &bodies, ThreadPool &pool, double time_step,
+                                    const BarnesHutSettings &settings = BarnesHutSettings(), Metrics *metrics = nullptr);
+// Walks the tree for bodies [start, end) with the given stack and adds what
+// it did to counters.
+void barnes_hut_update_step_aux(int start, int end, Scenario &bodies, QuadNode *root, double time_step, WalkCounters &counters,
+                                std::vector<QuadNode *> &stack);
+// Only every output_every-th step is recorded.
+void barnes_hut(Scenario &bodies, double time_step, double total_time, TrajectoryWriter &trajectory, int num_threads, int output_every = 1,
+                const BarnesHutSettings &settings = BarnesHutSettings());
 
 #endif // BARNES_HUT_MULTI_HPP
\ No newline at end of file
@@ -0,0 +1,82 @@
+#include "barnes_hut.hpp"
+#include "fmm.hpp"
+#include "benchmark.hpp"
+#include "initial_conditions.hpp"
+
+// Benchmarks of the sequential Barnes-Hut engine (pointer tree walk) on a
+// Plummer sphere, over N with and without tree refitting, and over the opening
+// angle and leaf size, and of the FMM solver over N.
+
+static Scenario make_scenario(size_t n) {
+    BodyTable table;
+    generate_plummer(n, table);
+    Scenario bodies;
+    unpack_bodies(table, bodies.m, bodies.r, bodies.v);
+    bodies.f.resize(n);
+    return bodies;
+}
+
+static BenchmarkResult run(const std::string &scaling, size_t n, double opening_angle, int leaf_size, bool refit, const BenchmarkOptions &options) {
+    const double time_step = 3600;
+    BenchmarkResult result;
+    result.engine = refit ? "barnes_hut_refit" : "barnes_hut";
+    result.scaling = scaling;
+    result.n = n;
+    result.theta = opening_angle;
+    result.leaf_size = leaf_size;
+
+    BarnesHutWorkspace workspace;
+    workspace.opening_angle = opening_angle;
+    workspace.leaf_capacity = leaf_size;
+    workspace.refit = refit;
+    const Scenario initial = make_scenario(n);
+    Scenario bodies;
+    time_steps(result, options,
+        [&] { bodies = initial; },
+        [&] {
+            barnes_hut_update_step(bodies, workspace, time_step);
+            return static_cast<double>(workspace.interactions);
+        });
+    return result;
+}
+
+// The solver keeps its default order; it counts no interactions
+static BenchmarkResult run_fmm(size_t n, const BenchmarkOptions &options) {
+    const double time_step = 3600;
+    BenchmarkResult result;
+    result.engine = "fmm";
+    result.scaling = "size";
+    result.n = n;
+
+    FmmSolver solver;
+    result.theta = solver.getTheta();
+    result.leaf_size = solver.getLeafSize();
+    const Scenario initial = make_scenario(n);
+    Scenario bodies;
+    time_steps(result, options,
+        [&] { bodies = initial; },
+        [&] {
+            fmm_update_step(bodies, solver, time_step);
+            return 0.0;
+        });
+    return result;
+}
+
+int main(int argc, char **argv) {
+    BenchmarkOptions options;
+    if (!parse_benchmark_options(argc, argv, options)) return 1;
+    BarnesHutWorkspace defaults;
+
+    BenchmarkReport report;
+    for (size_t n : options.sizes) {
+        report.add(run("size", n, defaults.opening_angle, defaults.leaf_capacity, false, options));
+        report.add(run("size", n, defaults.opening_angle, defaults.leaf_capacity, true, options));
+        report.add(run_fmm(n, options));
+    }
+    for (double opening_angle : options.thetas) {
+        for (int leaf_size : options.leaf_sizes) {
+            report.add(run("parameters", options.scaling_n, opening_angle, leaf_size, false, options));
+        }
+    }
+    return report.write(options) ? 0 : 1;
+}
@@ -0,0 +1,69 @@
+#include "barnes_hut_multi.hpp"
+#include "benchmark.hpp"
+#include "initial_conditions.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <iostream>
+
+// Benchmarks of the multi-threaded Barnes-Hut engine on a Plummer sphere, over
+// N and thread count, and over the opening angle and leaf size on all threads.
+
+static Scenario make_scenario(size_t n) {
+    BodyTable table;
+    generate_plummer(n, table);
+    Scenario bodies;
+    unpack_bodies(table, bodies.m, bodies.r, bodies.v);
+    bodies.f.assign(n, Vector2D(0, 0));
+    return bodies;
+}
+
+static BenchmarkResult run(const std::string &scaling, size_t n, int threads, const BarnesHutSettings &settings, const BenchmarkOptions &options) {
+    const double time_step = 3600;
+    BenchmarkResult result;
+    result.engine = "barnes_hut_multi";
+    result.scaling = scaling;
+    result.n = n;
+    result.threads = threads;
+    result.theta = settings.opening_angle;
+    result.leaf_size = settings.leaf_capacity;
+
+    ThreadPool pool(threads);
+    BarnesHutMultiWorkspace workspace;
+    const Scenario initial = make_scenario(n);
+    Scenario bodies;
+    time_steps(result, options,
+        [&] { bodies = initial; },
+        [&] { return static_cast<double>(barnes_hut_update_step_multi(bodies, pool, workspace, time_step, settings)); });
+    return result;
+}
+
+int main(int argc, char **argv) {
+    BenchmarkOptions options;
+    if (!parse_benchmark_options(argc, argv, options)) return 1;
+    if (!options.trace.empty() && !trace_start(options.trace)) return 1;
+    std::vector<int> thread_counts = benchmark_thread_counts(options);
+    int max_threads = *std::max_element(thread_counts.begin(), thread_counts.end());
+
+    BarnesHutSettings defaults;
+
+    BenchmarkReport report;
+    for (size_t n : options.sizes) {
+        report.add(run("size", n, max_threads, defaults, options));
+    }
+    for (int threads : thread_counts) {
+        report.add(run("strong", options.scaling_n, threads, defaults, options));
+    }
+    for (int threads : thread_counts) {
+        report.add(run("weak", options.scaling_n * threads, threads, defaults, options));
+    }
+    for (double opening_angle : options.thetas) {
+        for (int leaf_size : options.leaf_sizes) {
+            BarnesHutSettings settings;
+            settings.opening_angle = opening_angle;
+            settings.leaf_capacity = leaf_size;
+            report.add(run("parameters", options.scaling_n, max_threads, settings, options));
+        }
+    }
+    if (!options.trace.empty()) trace_stop();
+    return report.write(options) ? 0 : 1;
+}
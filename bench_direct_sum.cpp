@@ -0,0 +1,62 @@
+#include "nbody_simulation.hpp"
+#include "benchmark.hpp"
+#include "initial_conditions.hpp"
+#include <algorithm>
+
+// Benchmarks of the direct-sum engine: compute_forces_simd and update_bodies
+// from nbody_simulation.cpp, on a Plummer sphere.
+
+struct DirectSumState {
+    std::vector<double> masses;
+    std::vector<Vector2D> positions, velocities, forces;
+};
+
+static DirectSumState make_state(size_t n) {
+    BodyTable table;
+    generate_plummer(n, table);
+    DirectSumState state;
+    unpack_bodies(table, state.masses, state.positions, state.velocities);
+    state.forces.resize(n);
+    return state;
+}
+
+static BenchmarkResult run(const std::string &scaling, size_t n, int threads, const BenchmarkOptions &options) {
+    const double time_step = 3600;
+    BenchmarkResult result;
+    result.engine = "direct_sum";
+    result.scaling = scaling;
+    result.n = n;
+    result.threads = threads;
+
+    ThreadPool pool(threads);
+    BodiesSoA soa;
+    const DirectSumState initial = make_state(n);
+    DirectSumState state;
+    time_steps(result, options,
+        [&] { state = initial; },
+        [&] {
+            compute_forces_simd(n, state.masses, state.positions, state.forces, soa, pool);
+            update_bodies(n, state.masses, state.positions, state.velocities, state.forces, time_step, pool);
+            return static_cast<double>(n) * (n - 1);
+        });
+    return result;
+}
+
+int main(int argc, char **argv) {
+    BenchmarkOptions options;
+    if (!parse_benchmark_options(argc, argv, options)) return 1;
+    std::vector<int> thread_counts = benchmark_thread_counts(options);
+    int max_threads = *std::max_element(thread_counts.begin(), thread_counts.end());
+
+    BenchmarkReport report;
+    for (size_t n : options.sizes) {
+        if (n <= options.max_direct_n) report.add(run("size", n, max_threads, options));
+    }
+    for (int threads : thread_counts) {
+        report.add(run("strong", options.scaling_n, threads, options));
+    }
+    for (int threads : thread_counts) {
+        report.add(run("weak", options.scaling_n * threads, threads, options));
+    }
+    return report.write(options) ? 0 : 1;
+}
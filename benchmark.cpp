@@ -0,0 +1,180 @@
+#include "benchmark.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+template <typename T>
+static bool parse_list(const char *text, std::vector<T> &values) {
+    values.clear();
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        std::stringstream item_stream(item);
+        T value;
+        if (!(item_stream >> value)) return false;
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+static void print_usage(const char *program) {
+    std::cerr << "Usage: " << program << " [--sizes N,...] [--threads T,...] [--thetas X,...] [--leaf-sizes L,...]"
+              << " [--max-direct-n N] [--scaling-n N] [--steps S] [--repeats R] [--output file.json]"
+              << " [--trace trace.json] [--counters]\n";
+}
+
+bool parse_benchmark_options(int argc, char **argv, BenchmarkOptions &options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string flag = argv[i];
+        if (flag == "--counters") {
+            // Checked now so that an unusable PMU stops the run before it starts
+            if (!profile_start()) return false;
+            profile_stop();
+            options.counters = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return false;
+        }
+        const char *value = argv[++i];
+        bool ok = true;
+        if (flag == "--sizes") {
+            ok = parse_list(value, options.sizes);
+        } else if (flag == "--threads") {
+            ok = parse_list(value, options.threads);
+        } else if (flag == "--thetas") {
+            ok = parse_list(value, options.thetas);
+        } else if (flag == "--leaf-sizes") {
+            ok = parse_list(value, options.leaf_sizes);
+        } else if (flag == "--max-direct-n") {
+            options.max_direct_n = std::strtoull(value, nullptr, 10);
+        } else if (flag == "--scaling-n") {
+            options.scaling_n = std::max(1ULL, std::strtoull(value, nullptr, 10));
+        } else if (flag == "--steps") {
+            options.steps = std::max(1, std::atoi(value));
+        } else if (flag == "--repeats") {
+            options.repeats = std::max(1, std::atoi(value));
+        } else if (flag == "--output") {
+            options.output = value;
+        } else if (flag == "--trace") {
+            options.trace = value;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<int> benchmark_thread_counts(const BenchmarkOptions &options) {
+    if (!options.threads.empty()) return options.threads;
+    std::vector<int> counts;
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    for (int t = 1; t < cores; t *= 2) counts.push_back(t);
+    counts.push_back(cores);
+    return counts;
+}
+
+double BenchmarkResult::mean() const {
+    double sum = 0;
+    for (double s : step_seconds) sum += s;
+    return sum / step_seconds.size();
+}
+
+double BenchmarkResult::stddev() const {
+    double average = mean();
+    double sum = 0;
+    for (double s : step_seconds) sum += (s - average) * (s - average);
+    return step_seconds.size() > 1 ? std::sqrt(sum / (step_seconds.size() - 1)) : 0;
+}
+
+double BenchmarkResult::min() const {
+    return *std::min_element(step_seconds.begin(), step_seconds.end());
+}
+
+void BenchmarkReport::add(const BenchmarkResult &result) {
+    results.push_back(result);
+    std::cerr << result.engine << " " << result.scaling << ": n=" << result.n << " threads=" << result.threads;
+    if (result.theta > 0) std::cerr << " theta=" << result.theta << " leaf=" << result.leaf_size;
+    std::cerr << " -> " << result.stepsPerSecond() << " steps/s, " << result.interactionsPerSecond() << " interactions/s\n";
+    if (!result.counters.threads.empty()) {
+        result.counters.print(std::cerr, result.interactions_per_step * result.steps);
+    }
+}
+
+// Counts per step of every phase that ran, with IPC and misses per interaction.
+static void write_counters(std::ostream &out, const BenchmarkResult &r) {
+    double interactions = r.interactions_per_step * r.steps;
+    bool first = true;
+    out << ", \"counters\": {";
+    for (int p = 0; p < num_profile_phases; ++p) {
+        CounterValues c = r.counters.phase(static_cast<ProfilePhase>(p));
+        if (c.cycles == 0) continue;
+        out << (first ? "" : ", ") << "\"" << profile_phase_name(static_cast<ProfilePhase>(p)) << "\": {"
+            << "\"cycles_per_step\": " << double(c.cycles) / r.steps
+            << ", \"instructions_per_step\": " << double(c.instructions) / r.steps
+            << ", \"ipc\": " << c.ipc()
+            << ", \"cache_misses_per_step\": " << double(c.cache_misses) / r.steps
+            << ", \"branch_misses_per_step\": " << double(c.branch_misses) / r.steps;
+        if (interactions > 0) {
+            out << ", \"cache_misses_per_interaction\": " << c.cache_misses / interactions
+                << ", \"branch_misses_per_interaction\": " << c.branch_misses / interactions;
+        }
+        out << "}";
+        first = false;
+    }
+    out << "}";
+}
+
+// Strong scaling: speedup over one thread on the same N, divided by the thread
+// count. Weak scaling: interactions per second per thread, relative to one
+// thread, with the problem grown along with the threads.
+double BenchmarkReport::efficiency(const BenchmarkResult &result) const {
+    for (const BenchmarkResult &base : results) {
+        if (base.engine != result.engine || base.scaling != result.scaling || base.threads != 1) continue;
+        if (result.scaling == "strong" && base.n == result.n) {
+            return base.mean() / result.mean() / result.threads;
+        }
+        if (result.scaling == "weak") {
+            return result.interactionsPerSecond() / result.threads / base.interactionsPerSecond();
+        }
+    }
+    return -1;
+}
+
+bool BenchmarkReport::write(const BenchmarkOptions &options) const {
+    std::ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output);
+        if (!file.is_open()) {
+            std::cerr << "Error: cannot open " << options.output << "\n";
+            return false;
+        }
+    }
+    std::ostream &out = options.output.empty() ? std::cout : file;
+    out.precision(9);
+
+    out << "{\n  \"steps\": " << options.steps << ",\n  \"repeats\": " << options.repeats
+        << ",\n  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n  \"results\": [\n";
+    for (size_t k = 0; k < results.size(); ++k) {
+        const BenchmarkResult &r = results[k];
+        out << "    {\"engine\": \"" << r.engine << "\", \"scaling\": \"" << r.scaling << "\", \"n\": " << r.n
+            << ", \"threads\": " << r.threads << ", \"theta\": " << r.theta << ", \"leaf_size\": " << r.leaf_size
+            << ", \"seconds_per_step\": " << r.mean() << ", \"stddev\": " << r.stddev() << ", \"min\": " << r.min()
+            << ", \"steps_per_second\": " << r.stepsPerSecond() << ", \"interactions_per_second\": " << r.interactionsPerSecond();
+        double e = efficiency(r);
+        if (e >= 0) out << ", \"efficiency\": " << e;
+        if (!r.counters.threads.empty()) write_counters(out, r);
+        out << "}" << (k + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return out.good();
+}
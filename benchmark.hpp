@@ -0,0 +1,94 @@
+#ifndef BENCHMARK_HPP
+#define BENCHMARK_HPP
+
+#include "perf_counters.hpp"
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Sweep shared by the bench_* programs; each program uses the axes that apply
+// to its engine.
+struct BenchmarkOptions {
+    std::vector<size_t> sizes = {100, 1000, 10000, 100000, 1000000};
+    std::vector<int> threads; // Empty means 1, 2, 4, ... up to the core count
+    std::vector<double> thetas = {0.3, 0.5, 0.7, 1.0};
+    std::vector<int> leaf_sizes = {1, 2, 4, 8, 16, 32, 64};
+    size_t max_direct_n = 100000; // Direct sum is O(N^2); larger sizes are skipped
+    size_t scaling_n = 10000; // Bodies for strong scaling and the parameter sweep, and per thread for weak scaling
+    int steps = 3; // Time steps per timed run
+    int repeats = 5; // Timed runs per configuration
+    std::string output; // JSON file, standard output if empty
+    std::string trace; // Chrome trace of the whole sweep, for the engines that record one
+    bool counters = false; // Count hardware events per phase in one extra run per configuration
+};
+
+// Parses --sizes 100,1000 --threads 1,2 --thetas 0.5,1 --leaf-sizes 1,8
+// --max-direct-n N --scaling-n N --steps S --repeats R --output file.json
+// --trace trace.json --counters.
+// Returns false (and prints the usage) on anything else, and on --counters if
+// the hardware counters cannot be opened.
+bool parse_benchmark_options(int argc, char **argv, BenchmarkOptions &options);
+
+struct BenchmarkResult {
+    std::string engine;
+    std::string scaling; // "size", "strong", "weak" or "parameters"
+    size_t n = 0;
+    int threads = 1;
+    double theta = 0;
+    int leaf_size = 0;
+    int steps = 0;
+    double interactions_per_step = 0;
+    std::vector<double> step_seconds; // Seconds per step, one entry per repeat
+    ProfileReport counters; // Over one untimed run of `steps` steps; empty without --counters
+
+    double mean() const;
+    double stddev() const;
+    double min() const;
+    double stepsPerSecond() const { return 1 / mean(); }
+    double interactionsPerSecond() const { return interactions_per_step / mean(); }
+};
+
+class BenchmarkReport {
+public:
+    void add(const BenchmarkResult &result);
+
+    // Writes every result, with strong and weak scaling efficiency relative to
+    // the one-thread run of the same engine and sweep, to options.output.
+    bool write(const BenchmarkOptions &options) const;
+
+private:
+    double efficiency(const BenchmarkResult &result) const;
+
+    std::vector<BenchmarkResult> results;
+};
+
+// Runs setup() and then step() options.steps times, options.repeats times
+// over, after one untimed warm-up run. step() returns the interactions it
+// computed. With --counters, one more untimed run counts hardware events, so
+// reading the counters does not skew the timings.
+template <typename Setup, typename Step>
+void time_steps(BenchmarkResult &result, const BenchmarkOptions &options, Setup setup, Step step) {
+    result.steps = options.steps;
+    result.step_seconds.clear();
+    for (int run = -1; run < options.repeats; ++run) {
+        setup();
+        double interactions = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int s = 0; s < options.steps; ++s) interactions += step();
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        if (run < 0) continue;
+        result.step_seconds.push_back(duration.count() / options.steps);
+        result.interactions_per_step = interactions / options.steps;
+    }
+
+    if (options.counters && profile_start()) {
+        setup();
+        for (int s = 0; s < options.steps; ++s) step();
+        result.counters = profile_stop();
+    }
+}
+
+// Thread counts 1, 2, 4, ... up to the number of cores, unless given
+std::vector<int> benchmark_thread_counts(const BenchmarkOptions &options);
+
+#endif // BENCHMARK_HPP
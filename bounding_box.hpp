@@ -0,0 +1,66 @@
+#ifndef BOUNDING_BOX_HPP
+#define BOUNDING_BOX_HPP
+
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Square cell enclosing a set of points, used as the root of a quadtree.
+template <typename Vec>
+struct BoundingSquare {
+    Vec center;
+    double size;
+};
+
+struct MinMax {
+    double min_x, max_x, min_y, max_y;
+};
+
+template <typename Vec>
+MinMax min_max_segment(const std::vector<Vec> &points, int start, int end) {
+    MinMax box{INFINITY, -INFINITY, INFINITY, -INFINITY};
+    for (int i = start; i < end; ++i) {
+        box.min_x = std::min(box.min_x, points[i].x);
+        box.max_x = std::max(box.max_x, points[i].x);
+        box.min_y = std::min(box.min_y, points[i].y);
+        box.max_y = std::max(box.max_y, points[i].y);
+    }
+    return box;
+}
+
+template <typename Vec>
+BoundingSquare<Vec> square_from_min_max(const MinMax &box, bool empty, double padding) {
+    if (empty) return BoundingSquare<Vec>{Vec{0.0, 0.0}, 1.0};
+
+    double size = std::max(box.max_x - box.min_x, box.max_y - box.min_y) * (1 + padding);
+    if (size <= 0) size = std::max(1.0, std::max(std::fabs(box.min_x), std::fabs(box.min_y)) * 1e-9);
+    return BoundingSquare<Vec>{Vec{(box.min_x + box.max_x) / 2, (box.min_y + box.max_y) / 2}, size};
+}
+
+// Smallest square holding every point, widened by `padding` (a fraction of its
+// side) so points on the boundary end up strictly inside.
+template <typename Vec>
+BoundingSquare<Vec> bounding_square(const std::vector<Vec> &points, double padding = 0.01) {
+    return square_from_min_max<Vec>(min_max_segment(points, 0, points.size()), points.empty(), padding);
+}
+
+// Same, with the min/max reduction split across the threads of `pool`.
+template <typename Vec>
+BoundingSquare<Vec> bounding_square(const std::vector<Vec> &points, ThreadPool &pool, double padding = 0.01) {
+    std::vector<MinMax> partial(pool.size(), MinMax{INFINITY, -INFINITY, INFINITY, -INFINITY});
+    pool.parallel_for(0, points.size(), [&](int start, int end, int thread_id) {
+        partial[thread_id] = min_max_segment(points, start, end);
+    });
+
+    MinMax box = partial[0];
+    for (const MinMax &p : partial) {
+        box.min_x = std::min(box.min_x, p.min_x);
+        box.max_x = std::max(box.max_x, p.max_x);
+        box.min_y = std::min(box.min_y, p.min_y);
+        box.max_y = std::max(box.max_y, p.max_y);
+    }
+    return square_from_min_max<Vec>(box, points.empty(), padding);
+}
+
+#endif // BOUNDING_BOX_HPP
@@ -0,0 +1,216 @@
+#include "direct_sum.hpp"
+#include "perf_counters.hpp"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIRECT_SUM_X86 1
+#include <immintrin.h>
+#endif
+
+// Number of source bodies streamed per tile: x, y and m of a tile fit in L1.
+const std::size_t tile_size = 1024;
+
+void BodiesSoA::resize(std::size_t count) {
+    n = count;
+    std::size_t padded = (count + simd_width - 1) / simd_width * simd_width;
+    x.assign(padded, 0.0);
+    y.assign(padded, 0.0);
+    m.assign(padded, 0.0);
+    fx.assign(padded, 0.0);
+    fy.assign(padded, 0.0);
+    vx.assign(padded, 0.0);
+    vy.assign(padded, 0.0);
+    jx.assign(padded, 0.0);
+    jy.assign(padded, 0.0);
+}
+
+SimdLevel detect_simd_level() {
+#ifdef DIRECT_SUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SimdLevel::avx2;
+#endif
+    return SimdLevel::scalar;
+}
+
+std::string simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::avx512:
+            return "avx512";
+        case SimdLevel::avx2:
+            return "avx2";
+        default:
+            return "scalar";
+    }
+}
+
+static void forces_scalar(BodiesSoA &bodies, std::size_t start, std::size_t end, std::size_t j_begin, std::size_t j_end, double G) {
+    const double *x = bodies.x.data();
+    const double *y = bodies.y.data();
+    const double *m = bodies.m.data();
+    for (std::size_t i = start; i < end; ++i) {
+        double xi = x[i], yi = y[i];
+        double ax = 0, ay = 0;
+        for (std::size_t j = j_begin; j < j_end; ++j) {
+            double dx = x[j] - xi;
+            double dy = y[j] - yi;
+            double dist_squared = dx * dx + dy * dy;
+            if (dist_squared > 0) {
+                double inv_dist = 1.0 / std::sqrt(dist_squared);
+                double s = m[j] * inv_dist * inv_dist * inv_dist;
+                ax += s * dx;
+                ay += s * dy;
+            }
+        }
+        bodies.fx[i] += G * m[i] * ax;
+        bodies.fy[i] += G * m[i] * ay;
+    }
+}
+
+#ifdef DIRECT_SUM_X86
+__attribute__((target("avx2,fma")))
+static void forces_avx2(BodiesSoA &bodies, std::size_t start, std::size_t end, std::size_t j_begin, std::size_t j_end, double G) {
+    const double *x = bodies.x.data();
+    const double *y = bodies.y.data();
+    const double *m = bodies.m.data();
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1.0);
+    for (std::size_t i = start; i < end; ++i) {
+        __m256d xi = _mm256_set1_pd(x[i]);
+        __m256d yi = _mm256_set1_pd(y[i]);
+        __m256d ax = zero, ay = zero;
+        for (std::size_t j = j_begin; j < j_end; j += 4) {
+            __m256d dx = _mm256_sub_pd(_mm256_load_pd(x + j), xi);
+            __m256d dy = _mm256_sub_pd(_mm256_load_pd(y + j), yi);
+            __m256d dist_squared = _mm256_fmadd_pd(dx, dx, _mm256_mul_pd(dy, dy));
+            __m256d inv_dist = _mm256_div_pd(one, _mm256_sqrt_pd(dist_squared));
+            __m256d s = _mm256_mul_pd(_mm256_load_pd(m + j), _mm256_mul_pd(inv_dist, _mm256_mul_pd(inv_dist, inv_dist)));
+            // The body itself (and padding on top of it) sits at distance 0
+            s = _mm256_and_pd(s, _mm256_cmp_pd(dist_squared, zero, _CMP_GT_OQ));
+            ax = _mm256_fmadd_pd(s, dx, ax);
+            ay = _mm256_fmadd_pd(s, dy, ay);
+        }
+        double sx[4], sy[4];
+        _mm256_storeu_pd(sx, ax);
+        _mm256_storeu_pd(sy, ay);
+        bodies.fx[i] += G * m[i] * (sx[0] + sx[1] + sx[2] + sx[3]);
+        bodies.fy[i] += G * m[i] * (sy[0] + sy[1] + sy[2] + sy[3]);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void forces_avx512(BodiesSoA &bodies, std::size_t start, std::size_t end, std::size_t j_begin, std::size_t j_end, double G) {
+    const double *x = bodies.x.data();
+    const double *y = bodies.y.data();
+    const double *m = bodies.m.data();
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d half = _mm512_set1_pd(0.5);
+    const __m512d three_halves = _mm512_set1_pd(1.5);
+    for (std::size_t i = start; i < end; ++i) {
+        __m512d xi = _mm512_set1_pd(x[i]);
+        __m512d yi = _mm512_set1_pd(y[i]);
+        __m512d ax = zero, ay = zero;
+        for (std::size_t j = j_begin; j < j_end; j += 8) {
+            __m512d dx = _mm512_sub_pd(_mm512_load_pd(x + j), xi);
+            __m512d dy = _mm512_sub_pd(_mm512_load_pd(y + j), yi);
+            __m512d dist_squared = _mm512_fmadd_pd(dx, dx, _mm512_mul_pd(dy, dy));
+            __mmask8 nonzero = _mm512_cmp_pd_mask(dist_squared, zero, _CMP_GT_OQ);
+
+            // 14-bit estimate refined by two Newton-Raphson steps to full precision
+            __m512d inv_dist = _mm512_maskz_rsqrt14_pd(nonzero, dist_squared);
+            __m512d half_r2 = _mm512_mul_pd(half, dist_squared);
+            inv_dist = _mm512_mul_pd(inv_dist, _mm512_fnmadd_pd(half_r2, _mm512_mul_pd(inv_dist, inv_dist), three_halves));
+            inv_dist = _mm512_mul_pd(inv_dist, _mm512_fnmadd_pd(half_r2, _mm512_mul_pd(inv_dist, inv_dist), three_halves));
+
+            __m512d s = _mm512_maskz_mul_pd(nonzero, _mm512_load_pd(m + j), _mm512_mul_pd(inv_dist, _mm512_mul_pd(inv_dist, inv_dist)));
+            ax = _mm512_fmadd_pd(s, dx, ax);
+            ay = _mm512_fmadd_pd(s, dy, ay);
+        }
+        double sx[8], sy[8];
+        _mm512_storeu_pd(sx, ax);
+        _mm512_storeu_pd(sy, ay);
+        bodies.fx[i] += G * m[i] * (((sx[0] + sx[1]) + (sx[2] + sx[3])) + ((sx[4] + sx[5]) + (sx[6] + sx[7])));
+        bodies.fy[i] += G * m[i] * (((sy[0] + sy[1]) + (sy[2] + sy[3])) + ((sy[4] + sy[5]) + (sy[6] + sy[7])));
+    }
+}
+#endif
+
+void direct_sum_forces_segment(BodiesSoA &bodies, std::size_t start, std::size_t end, double G, SimdLevel level) {
+    std::fill(bodies.fx.begin() + start, bodies.fx.begin() + end, 0.0);
+    std::fill(bodies.fy.begin() + start, bodies.fy.begin() + end, 0.0);
+
+    std::size_t padded = bodies.x.size();
+    for (std::size_t j_begin = 0; j_begin < padded; j_begin += tile_size) {
+        std::size_t j_end = std::min(j_begin + tile_size, padded);
+        switch (level) {
+#ifdef DIRECT_SUM_X86
+            case SimdLevel::avx512:
+                forces_avx512(bodies, start, end, j_begin, j_end, G);
+                break;
+            case SimdLevel::avx2:
+                forces_avx2(bodies, start, end, j_begin, j_end, G);
+                break;
+#endif
+            default:
+                forces_scalar(bodies, start, end, j_begin, j_end, G);
+                break;
+        }
+    }
+}
+
+void direct_sum_forces(BodiesSoA &bodies, ThreadPool &pool, double G, SimdLevel level) {
+    pool.parallel_for(0, bodies.n, [&](int start, int end, int) {
+        ProfileScope profile(ProfilePhase::forces);
+        direct_sum_forces_segment(bodies, start, end, G, level);
+    });
+}
+
+// Written without branches so the compiler can vectorize the inner loop.
+static void jerk_on_body(BodiesSoA &bodies, std::size_t i, double G) {
+    const double *x = bodies.x.data();
+    const double *y = bodies.y.data();
+    const double *vx = bodies.vx.data();
+    const double *vy = bodies.vy.data();
+    const double *m = bodies.m.data();
+    std::size_t padded = bodies.x.size();
+    double xi = x[i], yi = y[i], vxi = vx[i], vyi = vy[i];
+    double ax = 0, ay = 0, jx = 0, jy = 0;
+    for (std::size_t j = 0; j < padded; ++j) {
+        double dx = x[j] - xi;
+        double dy = y[j] - yi;
+        double dvx = vx[j] - vxi;
+        double dvy = vy[j] - vyi;
+        double dist_squared = dx * dx + dy * dy;
+        double inv_dist = dist_squared > 0 ? 1.0 / std::sqrt(dist_squared) : 0.0;
+        double inv_dist2 = inv_dist * inv_dist;
+        double s = m[j] * inv_dist2 * inv_dist;
+        double rv = 3 * (dx * dvx + dy * dvy) * inv_dist2;
+        ax += s * dx;
+        ay += s * dy;
+        jx += s * (dvx - rv * dx);
+        jy += s * (dvy - rv * dy);
+    }
+    bodies.fx[i] = G * m[i] * ax;
+    bodies.fy[i] = G * m[i] * ay;
+    bodies.jx[i] = G * m[i] * jx;
+    bodies.jy[i] = G * m[i] * jy;
+}
+
+void direct_sum_jerk_segment(BodiesSoA &bodies, std::size_t start, std::size_t end, double G) {
+    for (std::size_t i = start; i < end; ++i) jerk_on_body(bodies, i, G);
+}
+
+void direct_sum_forces_and_jerks(BodiesSoA &bodies, ThreadPool &pool, double G) {
+    pool.parallel_for(0, bodies.n, [&](int start, int end, int) {
+        ProfileScope profile(ProfilePhase::forces);
+        direct_sum_jerk_segment(bodies, start, end, G);
+    });
+}
+
+void direct_sum_forces_and_jerks(BodiesSoA &bodies, const std::vector<int> &targets, ThreadPool &pool, double G) {
+    pool.parallel_for(0, targets.size(), [&](int start, int end, int) {
+        ProfileScope profile(ProfilePhase::forces);
+        for (int k = start; k < end; ++k) jerk_on_body(bodies, targets[k], G);
+    });
+}
@@ -0,0 +1,84 @@
+#ifndef DIRECT_SUM_HPP
+#define DIRECT_SUM_HPP
+
+#include "aligned_allocator.hpp"
+#include "thread_pool.hpp"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+typedef std::vector<double, AlignedAllocator<double, 64>> AlignedArray;
+
+// Bodies in structure-of-arrays layout. Every array is padded up to a multiple
+// of simd_width; padding bodies have zero mass and therefore exert no force.
+struct BodiesSoA {
+    static const std::size_t simd_width = 8;  // doubles in an AVX-512 register
+
+    std::size_t n = 0;
+    AlignedArray x, y, m;
+    AlignedArray fx, fy;
+    AlignedArray vx, vy, jx, jy; // Only used by the jerk kernel
+
+    void resize(std::size_t count);
+
+    // Copies masses and positions in from any AoS container whose elements have
+    // .x and .y members.
+    template <typename Vec>
+    void load(const std::vector<double> &masses, const std::vector<Vec> &positions) {
+        resize(positions.size());
+        for (std::size_t i = 0; i < n; ++i) {
+            x[i] = positions[i].x;
+            y[i] = positions[i].y;
+            m[i] = masses[i];
+        }
+    }
+
+    template <typename Vec>
+    void store_forces(std::vector<Vec> &forces) const {
+        forces.resize(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            forces[i].x = fx[i];
+            forces[i].y = fy[i];
+        }
+    }
+
+    // Velocities for the jerk kernel; call after load().
+    template <typename Vec>
+    void load_velocities(const std::vector<Vec> &velocities) {
+        for (std::size_t i = 0; i < n; ++i) {
+            vx[i] = velocities[i].x;
+            vy[i] = velocities[i].y;
+        }
+    }
+
+    template <typename Vec>
+    void store_jerks(std::vector<Vec> &jerks) const {
+        jerks.resize(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            jerks[i].x = jx[i];
+            jerks[i].y = jy[i];
+        }
+    }
+};
+
+enum class SimdLevel { scalar, avx2, avx512 };
+
+// Widest kernel the running CPU supports.
+SimdLevel detect_simd_level();
+std::string simd_level_name(SimdLevel level);
+
+// All-pairs forces on bodies [start, end) from every body, written to
+// bodies.fx / bodies.fy. Each pair costs one reciprocal square root.
+void direct_sum_forces_segment(BodiesSoA &bodies, std::size_t start, std::size_t end, double G, SimdLevel level);
+
+// Runs the kernel over all bodies, split by rows across the pool.
+void direct_sum_forces(BodiesSoA &bodies, ThreadPool &pool, double G, SimdLevel level);
+
+// Forces and their time derivatives (the jerk times the mass) on bodies
+// [start, end), written to fx / fy and jx / jy. Needs positions and velocities.
+void direct_sum_jerk_segment(BodiesSoA &bodies, std::size_t start, std::size_t end, double G);
+void direct_sum_forces_and_jerks(BodiesSoA &bodies, ThreadPool &pool, double G);
+// Same, only for the bodies listed in targets; the others keep their values.
+void direct_sum_forces_and_jerks(BodiesSoA &bodies, const std::vector<int> &targets, ThreadPool &pool, double G);
+
+#endif // DIRECT_SUM_HPP
@@ -0,0 +1,290 @@
+#include "fmm.hpp"
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+FmmSolver::FmmSolver(int order, double theta, int leaf_size)
+    : order(std::min(max_order, std::max(1, order))),
+      theta(theta),
+      leaf_size(leaf_size),
+      num_coefficients((this->order + 1) * (this->order + 2) / 2),
+      factorial(this->order + 2, 1.0),
+      double_factorial(this->order + 2, 1.0) {
+    for (int k = 1; k <= this->order + 1; ++k) {
+        factorial[k] = factorial[k - 1] * k;
+        double_factorial[k] = double_factorial[k - 1] * (2 * k - 1);
+    }
+    hermite.assign((max_order + 1) * (max_order + 1), 0.0);
+    for (int a = 0; a <= this->order; ++a) {
+        for (int i = 0; 2 * i <= a; ++i) {
+            hermite[a * (max_order + 1) + i] = factorial[a] / (std::pow(2.0, i) * factorial[i] * factorial[a - 2 * i]);
+        }
+    }
+    derivatives.resize(num_coefficients);
+    powers.resize(num_coefficients);
+}
+
+void FmmSolver::computeForces(Scenario &bodies) {
+    tree.build(bodies, leaf_size);
+    const std::vector<LinearNode> &nodes = tree.getNodes();
+    radius.assign(nodes.size(), 0.0);
+    multipoles.assign(nodes.size() * num_coefficients, 0.0);
+    locals.assign(nodes.size() * num_coefficients, 0.0);
+    acceleration.assign(bodies.r.size(), Vector2D{0, 0});
+
+    bodies.f.assign(bodies.r.size(), Vector2D{0.0, 0.0});
+    if (nodes.empty()) return;
+
+    upwardPass();
+    dualTreeWalk();
+    downwardPass();
+
+    const std::vector<int> &order = tree.bodyOrder();
+    for (size_t s = 0; s < order.size(); ++s) {
+        int i = order[s];
+        bodies.f[i] = acceleration[s] * (G * bodies.m[i]);
+    }
+}
+
+void FmmSolver::scaledPowers(const Vector2D &d, std::vector<double> &powers) const {
+    double px[max_order + 1], py[max_order + 1];
+    px[0] = py[0] = 1.0;
+    for (int k = 1; k <= order; ++k) {
+        px[k] = px[k - 1] * d.x / k;
+        py[k] = py[k - 1] * d.y / k;
+    }
+    for (int n = 0; n <= order; ++n) {
+        for (int b = 0; b <= n; ++b) {
+            powers[coefficientIndex(n - b, b)] = px[n - b] * py[b];
+        }
+    }
+}
+
+// Uses d^a/dx^a d^b/dy^b F(|r|^2 / 2) =
+//   sum_{i, j} a! / (2^i i! (a - 2i)!) b! / (2^j j! (b - 2j)!) x^(a-2i) y^(b-2j) F^(a+b-i-j)
+// with F(u) = (2u)^(-1/2), whose n-th derivative is (-1)^n (2n - 1)!! / |r|^(2n+1).
+void FmmSolver::kernelDerivatives(const Vector2D &r, std::vector<double> &derivatives) const {
+    double r2 = r.norm2();
+    double radial[max_order + 1], px[max_order + 1], py[max_order + 1];
+    double inv_power = 1.0 / std::sqrt(r2);
+    px[0] = py[0] = 1.0;
+    for (int n = 0; n <= order; ++n) {
+        radial[n] = (n % 2 ? -1.0 : 1.0) * double_factorial[n] * inv_power;
+        inv_power /= r2;
+        if (n > 0) {
+            px[n] = px[n - 1] * r.x;
+            py[n] = py[n - 1] * r.y;
+        }
+    }
+
+    for (int n = 0; n <= order; ++n) {
+        for (int b = 0; b <= n; ++b) {
+            int a = n - b;
+            double sum = 0;
+            for (int i = 0; 2 * i <= a; ++i) {
+                double cx = hermite[a * (max_order + 1) + i] * px[a - 2 * i];
+                double inner = 0;
+                for (int j = 0; 2 * j <= b; ++j) {
+                    inner += hermite[b * (max_order + 1) + j] * py[b - 2 * j] * radial[n - i - j];
+                }
+                sum += cx * inner;
+            }
+            derivatives[coefficientIndex(a, b)] = sum;
+        }
+    }
+}
+
+// Children of node k are k + 1, then each following subtree up to nodes[k].next
+void FmmSolver::upwardPass() {
+    const std::vector<LinearNode> &nodes = tree.getNodes();
+    for (int k = nodes.size() - 1; k >= 0; --k) {
+        if (nodes[k].is_leaf) {
+            particleToMultipole(k);
+            continue;
+        }
+        for (int c = k + 1; c < nodes[k].next; c = nodes[c].next) {
+            multipoleToMultipole(c, k);
+            double reach = std::sqrt((nodes[c].center_of_mass - nodes[k].center_of_mass).norm2()) + radius[c];
+            radius[k] = std::max(radius[k], reach);
+        }
+    }
+}
+
+void FmmSolver::particleToMultipole(int node) {
+    const LinearNode &cell = tree.getNodes()[node];
+    const std::vector<Vector2D> &r = tree.sortedPositions();
+    const std::vector<double> &m = tree.sortedMasses();
+    double *moments = &multipoles[node * num_coefficients];
+    for (int b = cell.first_body; b < cell.first_body + cell.num_bodies; ++b) {
+        Vector2D d = r[b] - cell.center_of_mass;
+        radius[node] = std::max(radius[node], std::sqrt(d.norm2()));
+        scaledPowers(d, powers);
+        for (int k = 0; k < num_coefficients; ++k) moments[k] += m[b] * powers[k];
+    }
+}
+
+void FmmSolver::multipoleToMultipole(int child, int parent) {
+    const std::vector<LinearNode> &nodes = tree.getNodes();
+    scaledPowers(nodes[child].center_of_mass - nodes[parent].center_of_mass, powers);
+    const double *from = &multipoles[child * num_coefficients];
+    double *to = &multipoles[parent * num_coefficients];
+    for (int n = 0; n <= order; ++n) {
+        for (int b = 0; b <= n; ++b) {
+            int a = n - b;
+            double sum = 0;
+            for (int ga = 0; ga <= a; ++ga) {
+                for (int gb = 0; gb <= b; ++gb) {
+                    sum += from[coefficientIndex(ga, gb)] * powers[coefficientIndex(a - ga, b - gb)];
+                }
+            }
+            to[coefficientIndex(a, b)] += sum;
+        }
+    }
+}
+
+void FmmSolver::multipoleToLocal(int source, int target) {
+    const std::vector<LinearNode> &nodes = tree.getNodes();
+    kernelDerivatives(nodes[target].center_of_mass - nodes[source].center_of_mass, derivatives);
+    const double *moments = &multipoles[source * num_coefficients];
+    double *local = &locals[target * num_coefficients];
+    for (int n = 0; n <= order; ++n) {
+        for (int b = 0; b <= n; ++b) {
+            int a = n - b;
+            double sum = 0;
+            for (int k = 0; k <= order - n; ++k) {
+                double sign = k % 2 ? -1.0 : 1.0;
+                for (int mb = 0; mb <= k; ++mb) {
+                    int ma = k - mb;
+                    sum += sign * moments[coefficientIndex(ma, mb)] * derivatives[coefficientIndex(a + ma, b + mb)];
+                }
+            }
+            local[coefficientIndex(a, b)] += sum;
+        }
+    }
+}
+
+void FmmSolver::localToLocal(int parent, int child) {
+    const std::vector<LinearNode> &nodes = tree.getNodes();
+    scaledPowers(nodes[child].center_of_mass - nodes[parent].center_of_mass, powers);
+    const double *from = &locals[parent * num_coefficients];
+    double *to = &locals[child * num_coefficients];
+    for (int n = 0; n <= order; ++n) {
+        for (int b = 0; b <= n; ++b) {
+            int a = n - b;
+            double sum = 0;
+            for (int k = n; k <= order; ++k) {
+                for (int gb = b; gb <= b + k - n; ++gb) {
+                    int ga = k - gb;
+                    if (ga < a) continue;
+                    sum += from[coefficientIndex(ga, gb)] * powers[coefficientIndex(ga - a, gb - b)];
+                }
+            }
+            to[coefficientIndex(a, b)] += sum;
+        }
+    }
+}
+
+void FmmSolver::localToParticle(int node) {
+    const LinearNode &cell = tree.getNodes()[node];
+    const std::vector<Vector2D> &r = tree.sortedPositions();
+    const double *local = &locals[node * num_coefficients];
+    for (int s = cell.first_body; s < cell.first_body + cell.num_bodies; ++s) {
+        scaledPowers(r[s] - cell.center_of_mass, powers);
+        Vector2D gradient{0, 0};
+        for (int n = 0; n < order; ++n) {
+            for (int b = 0; b <= n; ++b) {
+                int a = n - b;
+                gradient.x += local[coefficientIndex(a + 1, b)] * powers[coefficientIndex(a, b)];
+                gradient.y += local[coefficientIndex(a, b + 1)] * powers[coefficientIndex(a, b)];
+            }
+        }
+        acceleration[s] += gradient;
+    }
+}
+
+void FmmSolver::particleToParticle(int target, int source) {
+    const std::vector<LinearNode> &nodes = tree.getNodes();
+    const std::vector<Vector2D> &r = tree.sortedPositions();
+    const std::vector<double> &m = tree.sortedMasses();
+    const LinearNode &t = nodes[target];
+    const LinearNode &src = nodes[source];
+    for (int i = t.first_body; i < t.first_body + t.num_bodies; ++i) {
+        Vector2D a{0, 0};
+        for (int j = src.first_body; j < src.first_body + src.num_bodies; ++j) {
+            if (j == i) continue;
+            Vector2D dr = r[j] - r[i];
+            double dist_sq = std::max(dr.norm2(), 1e-6);  // Same softening as barnes_hut
+            a += dr * (m[j] / (dist_sq * std::sqrt(dist_sq)));
+        }
+        acceleration[i] += a;
+    }
+}
+
+void FmmSolver::dualTreeWalk() {
+    const std::vector<LinearNode> &nodes = tree.getNodes();
+    std::vector<std::pair<int, int>> stack;  // (target, source)
+    stack.push_back(std::make_pair(0, 0));
+    while (!stack.empty()) {
+        int target = stack.back().first;
+        int source = stack.back().second;
+        stack.pop_back();
+        const LinearNode &t = nodes[target];
+        const LinearNode &s = nodes[source];
+
+        if (target == source) {
+            if (t.is_leaf) {
+                particleToParticle(target, source);
+            } else {
+                for (int a = target + 1; a < t.next; a = nodes[a].next) {
+                    for (int b = target + 1; b < t.next; b = nodes[b].next) {
+                        stack.push_back(std::make_pair(a, b));
+                    }
+                }
+            }
+            continue;
+        }
+
+        double distance = std::sqrt((t.center_of_mass - s.center_of_mass).norm2());
+        if (radius[target] + radius[source] < theta * distance) {
+            multipoleToLocal(source, target);
+        } else if (t.is_leaf && s.is_leaf) {
+            particleToParticle(target, source);
+        } else if (s.is_leaf || (!t.is_leaf && radius[target] >= radius[source])) {
+            for (int a = target + 1; a < t.next; a = nodes[a].next) {
+                stack.push_back(std::make_pair(a, source));
+            }
+        } else {
+            for (int b = source + 1; b < s.next; b = nodes[b].next) {
+                stack.push_back(std::make_pair(target, b));
+            }
+        }
+    }
+}
+
+// Pre-order visits every parent before its children
+void FmmSolver::downwardPass() {
+    const std::vector<LinearNode> &nodes = tree.getNodes();
+    for (size_t k = 0; k < nodes.size(); ++k) {
+        if (nodes[k].is_leaf) {
+            localToParticle(k);
+            continue;
+        }
+        for (int c = k + 1; c < nodes[k].next; c = nodes[c].next) {
+            localToLocal(k, c);
+        }
+    }
+}
+
+void fmm_update_step(Scenario &bodies, FmmSolver &solver, double time_step) {
+    solver.computeForces(bodies);
+
+    for (size_t i = 0; i < bodies.r.size(); i++) {
+        bodies.v[i] += bodies.f[i] * (time_step / bodies.m[i]);
+        bodies.r[i] += bodies.v[i] * time_step;
+    }
+}
+
+void fmm_update_step(Scenario &bodies, double time_step) {
+    FmmSolver solver;
+    fmm_update_step(bodies, solver, time_step);
+}
@@ -0,0 +1,71 @@
+#ifndef FMM_HPP
+#define FMM_HPP
+
+#include "linear_quadtree.hpp"
+#include <vector>
+
+// Fast multipole solver for the same 1/r^2 force law as barnes_hut.
+//
+// Each cell carries a Cartesian multipole expansion of order `order` about its
+// center of mass (built by P2M/M2M on the way up) and a local expansion
+// (filled by M2L from a dual-tree traversal, pushed down by L2L). Pairs of
+// cells that fail the acceptance test (r_A + r_B < theta * distance) are split
+// until they pass or both are leaves, which interact directly. Error falls
+// roughly as theta^(order + 1) up to order 12; beyond it the kernel
+// derivatives lose precision in double arithmetic and the error grows again
+// (p99 at theta 0.3: 1.2e-7 at order 12, 1.7e-5 at 13, 8e-5 at 16), so larger
+// orders are clamped to max_order.
+class FmmSolver {
+public:
+    static const int max_order = 12;
+
+    explicit FmmSolver(int order = 6, double theta = 0.5, int leaf_size = 16);
+
+    // Fills bodies.f with the force on every body.
+    void computeForces(Scenario &bodies);
+
+    int getOrder() const { return order; }
+    double getTheta() const { return theta; }
+    int getLeafSize() const { return leaf_size; }
+
+private:
+    int coefficientIndex(int a, int b) const { return (a + b) * (a + b + 1) / 2 + b; }
+
+    void upwardPass();
+    void dualTreeWalk();
+    void downwardPass();
+
+    void particleToMultipole(int node);
+    void multipoleToMultipole(int child, int parent);
+    void multipoleToLocal(int source, int target);
+    void localToLocal(int parent, int child);
+    void localToParticle(int node);
+    void particleToParticle(int target, int source);
+
+    // Fills `derivatives` with d^(a+b) / dx^a dy^b of 1/|r| for a + b <= order
+    void kernelDerivatives(const Vector2D &r, std::vector<double> &derivatives) const;
+    // Fills powers[k] = d.x^a d.y^b / (a! b!) for every coefficient k
+    void scaledPowers(const Vector2D &d, std::vector<double> &powers) const;
+
+    int order;
+    double theta;
+    int leaf_size;
+    int num_coefficients;
+
+    LinearQuadtree tree;
+    std::vector<double> radius;
+    std::vector<double> multipoles;
+    std::vector<double> locals;
+    std::vector<Vector2D> acceleration;  // per Morton-sorted body, without G
+
+    std::vector<double> factorial;
+    std::vector<double> double_factorial;  // (2n - 1)!!
+    std::vector<double> hermite;           // a! / (2^i i! (a - 2i)!) at [a][i]
+    std::vector<double> derivatives, powers;
+};
+
+// Drop-in replacements for barnes_hut_update_step using the FMM solver.
+void fmm_update_step(Scenario &bodies, FmmSolver &solver, double time_step);
+void fmm_update_step(Scenario &bodies, double time_step);
+
+#endif // FMM_HPP
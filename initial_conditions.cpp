@@ -0,0 +1,318 @@
+#include "initial_conditions.hpp"
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const double G = 6.67430e-11;
+static const char binary_magic[8] = {'N', 'B', 'B', 'O', 'D', 'Y', '0', '1'};
+
+// Read-only mapping of a whole file, unmapped when it goes out of scope
+class MappedFile {
+public:
+    ~MappedFile() {
+        if (data) munmap(const_cast<char *>(data), size);
+    }
+
+    bool open(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Error: cannot open " << path << "\n";
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        size = info.st_size;
+        if (size > 0) {
+            void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                std::cerr << "Error: cannot map " << path << "\n";
+                size = 0;
+                ::close(fd);
+                return false;
+            }
+            data = static_cast<const char *>(mapped);
+        }
+        ::close(fd);
+        return true;
+    }
+
+    const char *data = nullptr;
+    size_t size = 0;
+};
+
+static const char *skip_blanks(const char *begin, const char *end) {
+    while (begin < end && (*begin == ' ' || *begin == '\t' || *begin == '\r')) ++begin;
+    return begin;
+}
+
+// Blank lines, comments and a header (a line starting with a letter) carry no body
+static bool is_data_line(const char *begin, const char *end) {
+    begin = skip_blanks(begin, end);
+    return begin < end && *begin != '#' && !std::isalpha(static_cast<unsigned char>(*begin));
+}
+
+static const char *line_end(const char *begin, const char *end) {
+    const char *newline = static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+    return newline ? newline : end;
+}
+
+// Parses "m, x, y, vx, vy" (commas or whitespace) from [begin, end) into
+// values. Each number is copied out on its own, since the mapped line has no
+// terminator for strtod; numbers of 64 characters or more, and anything but
+// blanks after the fifth, are errors.
+static bool parse_line(const char *begin, const char *end, double values[5]) {
+    const char *cursor = skip_blanks(begin, end);
+    for (int k = 0; k < 5; ++k) {
+        if (k > 0 && cursor < end && *cursor == ',') cursor = skip_blanks(cursor + 1, end);
+        const char *field = cursor;
+        while (cursor < end && *cursor != ',' && *cursor != ' ' && *cursor != '\t' && *cursor != '\r') ++cursor;
+
+        char buffer[64];
+        size_t length = cursor - field;
+        if (length == 0 || length >= sizeof(buffer)) return false;
+        std::memcpy(buffer, field, length);
+        buffer[length] = '\0';
+        char *next;
+        values[k] = std::strtod(buffer, &next);
+        if (next != buffer + length) return false;
+        cursor = skip_blanks(cursor, end);
+    }
+    return cursor == end && values[0] > 0;
+}
+
+bool load_csv(const std::string &path, BodyTable &bodies, ThreadPool &pool) {
+    MappedFile file;
+    if (!file.open(path)) return false;
+    const char *data = file.data;
+    const char *end = data + file.size;
+
+    // Cut the file into one block per thread, each starting at a line
+    int num_blocks = pool.size();
+    std::vector<const char *> block_start(num_blocks + 1, end);
+    block_start[0] = data;
+    for (int b = 1; b < num_blocks; ++b) {
+        const char *guess = data + file.size * b / num_blocks;
+        if (guess < block_start[b - 1]) guess = block_start[b - 1];
+        const char *newline = line_end(guess, end);
+        block_start[b] = newline < end ? newline + 1 : end;
+    }
+
+    // First pass counts the bodies in each block so the second can write
+    // straight into place
+    std::vector<size_t> count(num_blocks, 0);
+    std::vector<size_t> lines(num_blocks, 0);
+    pool.run([&](int b) {
+        for (const char *line = block_start[b]; line < block_start[b + 1];) {
+            const char *stop = line_end(line, block_start[b + 1]);
+            if (is_data_line(line, stop)) count[b]++;
+            lines[b]++;
+            line = stop + 1;
+        }
+    });
+
+    std::vector<size_t> first_body(num_blocks + 1, 0);
+    std::vector<size_t> first_line(num_blocks + 1, 0);
+    for (int b = 0; b < num_blocks; ++b) {
+        first_body[b + 1] = first_body[b] + count[b];
+        first_line[b + 1] = first_line[b] + lines[b];
+    }
+    bodies.resize(first_body[num_blocks]);
+
+    // First malformed line of each block, 0 if none
+    std::vector<size_t> bad_line(num_blocks, 0);
+    pool.run([&](int b) {
+        size_t index = first_body[b];
+        size_t line_number = first_line[b];
+        for (const char *line = block_start[b]; line < block_start[b + 1];) {
+            const char *stop = line_end(line, block_start[b + 1]);
+            line_number++;
+            if (is_data_line(line, stop)) {
+                double values[5];
+                if (!parse_line(line, stop, values)) {
+                    if (bad_line[b] == 0) bad_line[b] = line_number;
+                    values[0] = values[1] = values[2] = values[3] = values[4] = 0;
+                }
+                bodies.m[index] = values[0];
+                bodies.x[index] = values[1];
+                bodies.y[index] = values[2];
+                bodies.vx[index] = values[3];
+                bodies.vy[index] = values[4];
+                index++;
+            }
+            line = stop + 1;
+        }
+    });
+
+    for (int b = 0; b < num_blocks; ++b) {
+        if (bad_line[b] != 0) {
+            std::cerr << "Error: " << path << ":" << bad_line[b] << ": expected mass > 0, x, y, vx, vy\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool load_binary(const std::string &path, BodyTable &bodies, ThreadPool &pool) {
+    MappedFile file;
+    if (!file.open(path)) return false;
+    uint64_t n = 0;
+    if (file.size >= 16) std::memcpy(&n, file.data + 8, sizeof(n));
+    // n is checked against the size before multiplying, and must fit the
+    // pool's int ranges
+    if (file.size < 16 || std::memcmp(file.data, binary_magic, 8) != 0 || n > (file.size - 16) / (5 * sizeof(double)) ||
+        n > static_cast<uint64_t>(INT_MAX) || file.size != 16 + 5 * n * sizeof(double)) {
+        std::cerr << "Error: " << path << " is not a body file\n";
+        return false;
+    }
+
+    bodies.resize(n);
+    const char *arrays = file.data + 16;
+    std::vector<double> *columns[5] = {&bodies.m, &bodies.x, &bodies.y, &bodies.vx, &bodies.vy};
+    pool.parallel_for(0, n, [&](int start, int end, int) {
+        for (int c = 0; c < 5; ++c) {
+            std::memcpy(columns[c]->data() + start, arrays + (c * n + start) * sizeof(double), (end - start) * sizeof(double));
+        }
+    });
+    return true;
+}
+
+bool save_binary(const std::string &path, const BodyTable &bodies) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        std::cerr << "Error: cannot open " << path << "\n";
+        return false;
+    }
+    uint64_t n = bodies.size();
+    file.write(binary_magic, sizeof(binary_magic));
+    file.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    for (const std::vector<double> *column : {&bodies.m, &bodies.x, &bodies.y, &bodies.vx, &bodies.vy}) {
+        file.write(reinterpret_cast<const char *>(column->data()), n * sizeof(double));
+    }
+    return file.good();
+}
+
+// Adds count bodies uniformly spread over a disk centred on (cx, cy), each on
+// the circular orbit set by the disk mass inside its radius, and all moving
+// with the disk at (vx, vy).
+static void add_disk(BodyTable &bodies, size_t count, double radius, double mass, double cx, double cy, double vx, double vy, std::mt19937 &rng) {
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    size_t first = bodies.size();
+    bodies.resize(first + count);
+    for (size_t i = first; i < first + count; ++i) {
+        double r = radius * std::sqrt(uniform(rng));
+        double angle = 2 * M_PI * uniform(rng);
+        double speed = std::sqrt(G * mass * r) / radius;
+        bodies.m[i] = mass / count;
+        bodies.x[i] = cx + r * std::cos(angle);
+        bodies.y[i] = cy + r * std::sin(angle);
+        bodies.vx[i] = vx - speed * std::sin(angle);
+        bodies.vy[i] = vy + speed * std::cos(angle);
+    }
+}
+
+void generate_uniform_disk(size_t n, BodyTable &bodies, double radius, double total_mass, unsigned seed) {
+    std::mt19937 rng(seed);
+    bodies.resize(0);
+    add_disk(bodies, n, radius, total_mass, 0, 0, 0, 0, rng);
+}
+
+void generate_plummer(size_t n, BodyTable &bodies, double scale_radius, double total_mass, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    double velocity_scale = std::sqrt(2 * G * total_mass / scale_radius);
+    bodies.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        // Radius from the inverse of the cumulative mass profile, cut at 10 a
+        double r;
+        do {
+            r = scale_radius / std::sqrt(std::pow(uniform(rng), -2.0 / 3.0) - 1);
+        } while (r > 10 * scale_radius);
+
+        // Speed as a fraction q of the local escape speed (Aarseth et al. 1974)
+        double q, p;
+        do {
+            q = uniform(rng);
+            p = 0.1 * uniform(rng);
+        } while (p > q * q * std::pow(1 - q * q, 3.5));
+        double speed = q * velocity_scale * std::pow(1 + r * r / (scale_radius * scale_radius), -0.25);
+
+        // Isotropic directions in 3D, keeping only x and y
+        double cos_theta = 2 * uniform(rng) - 1;
+        double phi = 2 * M_PI * uniform(rng);
+        double sin_theta = std::sqrt(1 - cos_theta * cos_theta);
+        double v_cos_theta = 2 * uniform(rng) - 1;
+        double v_phi = 2 * M_PI * uniform(rng);
+        double v_sin_theta = std::sqrt(1 - v_cos_theta * v_cos_theta);
+
+        bodies.m[i] = total_mass / n;
+        bodies.x[i] = r * sin_theta * std::cos(phi);
+        bodies.y[i] = r * sin_theta * std::sin(phi);
+        bodies.vx[i] = speed * v_sin_theta * std::cos(v_phi);
+        bodies.vy[i] = speed * v_sin_theta * std::sin(v_phi);
+    }
+}
+
+void generate_colliding_disks(size_t n, BodyTable &bodies, double radius, double total_mass, unsigned seed) {
+    std::mt19937 rng(seed);
+    bodies.resize(0);
+    // Start four radii apart, slightly off axis, closing at the speed two
+    // point masses would reach falling from infinity to that distance
+    double separation = 4 * radius;
+    double approach = std::sqrt(2 * G * total_mass / separation);
+    add_disk(bodies, n / 2, radius, total_mass / 2, -separation / 2, -radius / 4, approach / 2, 0, rng);
+    add_disk(bodies, n - n / 2, radius, total_mass / 2, separation / 2, radius / 4, -approach / 2, 0, rng);
+}
+
+void generate_solar_system(BodyTable &bodies) {
+    bodies.m = {1.9885e30, 3.3011e23, 4.8675e24, 5.9724e24, 6.4171e23, 1.8982e27, 5.6834e26, 8.6810e25, 1.0241e26};
+    bodies.x = {0, 5.7e10, 1.08e11, 1.496e11, 2.279e11, 7.785e11, 1.429e12, 2.871e12, 4.498e12};
+    bodies.y.assign(9, 0.0);
+    bodies.vx.assign(9, 0.0);
+    bodies.vy = {0, 4.74e4, 3.5e4, 2.98e4, 2.41e4, 1.31e4, 9.7e3, 6.8e3, 5.43e3};
+}
+
+static bool ends_with(const std::string &text, const std::string &suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool load_bodies(int argc, char **argv, BodyTable &bodies, ThreadPool &pool) {
+    if (argc < 1) return false;
+    std::string source = argv[0];
+    size_t n = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000;
+
+    if (ends_with(source, ".csv")) return load_csv(source, bodies, pool);
+    if (ends_with(source, ".bin")) return load_binary(source, bodies, pool);
+    if (source == "solar") {
+        generate_solar_system(bodies);
+        return true;
+    }
+    if (n > 0) {
+        if (source == "disk") {
+            generate_uniform_disk(n, bodies);
+            return true;
+        }
+        if (source == "plummer") {
+            generate_plummer(n, bodies);
+            return true;
+        }
+        if (source == "collision") {
+            generate_colliding_disks(n, bodies);
+            return true;
+        }
+    }
+    std::cerr << "Usage: <bodies.csv | bodies.bin | disk N | plummer N | collision N | solar>\n";
+    return false;
+}
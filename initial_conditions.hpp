@@ -0,0 +1,62 @@
+#ifndef INITIAL_CONDITIONS_HPP
+#define INITIAL_CONDITIONS_HPP
+
+#include "thread_pool.hpp"
+#include <string>
+#include <vector>
+
+// Masses, positions and velocities of a set of bodies, independent of the
+// Vector2D type of each program.
+struct BodyTable {
+    std::vector<double> m, x, y, vx, vy;
+
+    size_t size() const { return m.size(); }
+    void resize(size_t n) {
+        m.resize(n);
+        x.resize(n);
+        y.resize(n);
+        vx.resize(n);
+        vy.resize(n);
+    }
+};
+
+// CSV with one body per line: mass, x, y, vx, vy. Blank lines, lines starting
+// with '#' and a header line are skipped. The file is mapped and parsed in
+// parallel, one block of lines per thread. Returns false (and reports the
+// first bad line) if a line has other than five numbers.
+bool load_csv(const std::string &path, BodyTable &bodies, ThreadPool &pool);
+
+// Binary format: "NBBODY01", uint64 number of bodies, then the m, x, y, vx
+// and vy arrays as doubles.
+bool load_binary(const std::string &path, BodyTable &bodies, ThreadPool &pool);
+bool save_binary(const std::string &path, const BodyTable &bodies);
+
+// Generators. Positions are in meters, masses in kg and velocities in m/s, so
+// they plug straight into the simulations.
+void generate_uniform_disk(size_t n, BodyTable &bodies, double radius = 1e12, double total_mass = 2e30, unsigned seed = 305);
+// Plummer sphere of scale radius a, sampled in 3D and projected onto the plane
+void generate_plummer(size_t n, BodyTable &bodies, double scale_radius = 1e12, double total_mass = 2e30, unsigned seed = 305);
+// Two rotating uniform disks of n / 2 bodies each, heading towards each other
+void generate_colliding_disks(size_t n, BodyTable &bodies, double radius = 1e12, double total_mass = 2e30, unsigned seed = 305);
+void generate_solar_system(BodyTable &bodies);
+
+// Fills bodies from command line arguments: a .csv or .bin file name, or one
+// of "disk", "plummer", "collision" or "solar" followed by the number of
+// bodies. Returns false (and prints the usage) if the arguments make no sense.
+bool load_bodies(int argc, char **argv, BodyTable &bodies, ThreadPool &pool);
+
+template <typename Vec>
+void unpack_bodies(const BodyTable &bodies, std::vector<double> &masses, std::vector<Vec> &positions, std::vector<Vec> &velocities) {
+    size_t n = bodies.size();
+    masses = bodies.m;
+    positions.resize(n);
+    velocities.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        positions[i].x = bodies.x[i];
+        positions[i].y = bodies.y[i];
+        velocities[i].x = bodies.vx[i];
+        velocities[i].y = bodies.vy[i];
+    }
+}
+
+#endif // INITIAL_CONDITIONS_HPP
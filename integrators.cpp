@@ -0,0 +1,271 @@
+#include "integrators.hpp"
+#include <algorithm>
+#include <cmath>
+
+const double block_eta = 0.02; // Block steps are about block_eta * |a| / |jerk|
+const int max_block_level = 20; // Shortest block step is time_step / 2^20
+
+std::string integrator_name(Integrator integrator) {
+    switch (integrator) {
+        case Integrator::leapfrog:
+            return "leapfrog";
+        case Integrator::yoshida4:
+            return "yoshida4";
+        case Integrator::hermite4:
+            return "hermite4";
+        case Integrator::hermite4_block:
+            return "hermite4_block";
+        default:
+            return "euler";
+    }
+}
+
+bool parse_integrator(const std::string &name, Integrator &integrator) {
+    const Integrator all[] = {Integrator::euler, Integrator::leapfrog, Integrator::yoshida4, Integrator::hermite4, Integrator::hermite4_block};
+    for (Integrator candidate : all) {
+        if (integrator_name(candidate) == name) {
+            integrator = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+DirectSumIntegrator::DirectSumIntegrator(Integrator method, ThreadPool &pool, double G)
+    : integrator(method), pool(pool), G(G), level(detect_simd_level()) {}
+
+void DirectSumIntegrator::evaluate(const std::vector<double> &masses, const std::vector<Vector2D> &positions, const std::vector<Vector2D> &velocities) {
+    ProfileScope profile(ProfilePhase::forces);
+    soa.load(masses, positions);
+    if (integrator == Integrator::hermite4 || integrator == Integrator::hermite4_block) {
+        soa.load_velocities(velocities);
+        direct_sum_forces_and_jerks(soa, pool, G);
+        soa.store_jerks(jerk);
+    } else {
+        direct_sum_forces(soa, pool, G, level);
+    }
+    soa.store_forces(force);
+    evaluations++;
+    body_evaluations += positions.size();
+}
+
+void DirectSumIntegrator::step(const std::vector<double> &masses, std::vector<Vector2D> &positions, std::vector<Vector2D> &velocities,
+                               std::vector<Vector2D> &forces, double time_step) {
+    // Yoshida's fourth-order weights: w1 + w0 + w1 = 1, with w0 < 0
+    const double cbrt2 = std::cbrt(2.0);
+    const double w1 = 1 / (2 - cbrt2);
+    const double w0 = -cbrt2 / (2 - cbrt2);
+
+    if (force.size() != positions.size()) primed = false;
+    switch (integrator) {
+        case Integrator::leapfrog:
+            if (!primed) evaluate(masses, positions, velocities);
+            leapfrog(masses, positions, velocities, time_step);
+            break;
+        case Integrator::yoshida4:
+            if (!primed) evaluate(masses, positions, velocities);
+            leapfrog(masses, positions, velocities, w1 * time_step);
+            leapfrog(masses, positions, velocities, w0 * time_step);
+            leapfrog(masses, positions, velocities, w1 * time_step);
+            break;
+        case Integrator::hermite4:
+            if (!primed) evaluate(masses, positions, velocities);
+            hermite(masses, positions, velocities, time_step);
+            break;
+        case Integrator::hermite4_block:
+            if (!primed) evaluate(masses, positions, velocities);
+            blockHermite(masses, positions, velocities, time_step);
+            break;
+        default:
+            // Forces of the start of the step, like update_bodies
+            evaluate(masses, positions, velocities);
+            pool.parallel_for(0, positions.size(), [&](int start, int end, int) {
+                ProfileScope profile(ProfilePhase::integrate);
+                for (int i = start; i < end; ++i) {
+                    velocities[i].x += force[i].x / masses[i] * time_step;
+                    velocities[i].y += force[i].y / masses[i] * time_step;
+                    positions[i].x += velocities[i].x * time_step;
+                    positions[i].y += velocities[i].y * time_step;
+                }
+            });
+            break;
+    }
+    primed = integrator != Integrator::euler;
+    forces = force;
+}
+
+void DirectSumIntegrator::leapfrog(const std::vector<double> &masses, std::vector<Vector2D> &positions, std::vector<Vector2D> &velocities, double time_step) {
+    const double half = time_step / 2;
+    pool.parallel_for(0, positions.size(), [&](int start, int end, int) {
+        ProfileScope profile(ProfilePhase::integrate);
+        for (int i = start; i < end; ++i) {
+            velocities[i].x += force[i].x / masses[i] * half;
+            velocities[i].y += force[i].y / masses[i] * half;
+            positions[i].x += velocities[i].x * time_step;
+            positions[i].y += velocities[i].y * time_step;
+        }
+    });
+
+    evaluate(masses, positions, velocities);
+
+    pool.parallel_for(0, positions.size(), [&](int start, int end, int) {
+        ProfileScope profile(ProfilePhase::integrate);
+        for (int i = start; i < end; ++i) {
+            velocities[i].x += force[i].x / masses[i] * half;
+            velocities[i].y += force[i].y / masses[i] * half;
+        }
+    });
+}
+
+void DirectSumIntegrator::hermite(const std::vector<double> &masses, std::vector<Vector2D> &positions, std::vector<Vector2D> &velocities, double time_step) {
+    const double dt = time_step, dt2 = dt * dt, dt3 = dt2 * dt;
+    r0 = positions;
+    v0 = velocities;
+    force0 = force;
+    jerk0 = jerk;
+
+    // Predict with the Taylor series of the start of the step
+    pool.parallel_for(0, positions.size(), [&](int start, int end, int) {
+        ProfileScope profile(ProfilePhase::integrate);
+        for (int i = start; i < end; ++i) {
+            double ax = force0[i].x / masses[i], ay = force0[i].y / masses[i];
+            double jx = jerk0[i].x / masses[i], jy = jerk0[i].y / masses[i];
+            positions[i].x = r0[i].x + v0[i].x * dt + ax * dt2 / 2 + jx * dt3 / 6;
+            positions[i].y = r0[i].y + v0[i].y * dt + ay * dt2 / 2 + jy * dt3 / 6;
+            velocities[i].x = v0[i].x + ax * dt + jx * dt2 / 2;
+            velocities[i].y = v0[i].y + ay * dt + jy * dt2 / 2;
+        }
+    });
+
+    evaluate(masses, positions, velocities);
+
+    // Correct with the forces and jerks at both ends of the step
+    pool.parallel_for(0, positions.size(), [&](int start, int end, int) {
+        ProfileScope profile(ProfilePhase::integrate);
+        for (int i = start; i < end; ++i) {
+            double inv_m = 1 / masses[i];
+            double ax0 = force0[i].x * inv_m, ay0 = force0[i].y * inv_m;
+            double ax1 = force[i].x * inv_m, ay1 = force[i].y * inv_m;
+            double jx0 = jerk0[i].x * inv_m, jy0 = jerk0[i].y * inv_m;
+            double jx1 = jerk[i].x * inv_m, jy1 = jerk[i].y * inv_m;
+            velocities[i].x = v0[i].x + (ax0 + ax1) * dt / 2 + (jx0 - jx1) * dt2 / 12;
+            velocities[i].y = v0[i].y + (ay0 + ay1) * dt / 2 + (jy0 - jy1) * dt2 / 12;
+            positions[i].x = r0[i].x + (v0[i].x + velocities[i].x) * dt / 2 + (ax0 - ax1) * dt2 / 12;
+            positions[i].y = r0[i].y + (v0[i].y + velocities[i].y) * dt / 2 + (ay0 - ay1) * dt2 / 12;
+        }
+    });
+}
+
+int DirectSumIntegrator::blockLevel(size_t i, double time_step) const {
+    double a = std::hypot(force[i].x, force[i].y);
+    double j = std::hypot(jerk[i].x, jerk[i].y);
+    if (j == 0) return 0;
+    double wanted = block_eta * a / j;
+    int k = 0;
+    while (k < max_block_level && std::ldexp(time_step, -k) > wanted) k++;
+    return k;
+}
+
+// Hermite with block time steps. A substep goes to the earliest time any body
+// is due, predicts every body to that time from its own last state, computes
+// forces on the due bodies only and corrects them. A body's step can shrink at
+// any of its substeps but only doubles where the longer step stays aligned, so
+// that all bodies meet again at time_step.
+void DirectSumIntegrator::blockHermite(const std::vector<double> &masses, std::vector<Vector2D> &positions, std::vector<Vector2D> &velocities, double time_step) {
+    const size_t n = positions.size();
+    if (step_level.size() != n || block_step != time_step) {
+        step_level.resize(n);
+        for (size_t i = 0; i < n; ++i) step_level[i] = blockLevel(i, time_step);
+        block_step = time_step;
+    }
+    const uint64_t end_tick = uint64_t(1) << max_block_level;
+    const double tick = time_step / end_tick;
+    body_tick.assign(n, 0);
+    predicted_r.resize(n);
+    predicted_v.resize(n);
+
+    uint64_t now = 0;
+    while (now < end_tick) {
+        uint64_t next = end_tick;
+        for (size_t i = 0; i < n; ++i) next = std::min(next, body_tick[i] + (end_tick >> step_level[i]));
+        active.clear();
+        for (size_t i = 0; i < n; ++i) {
+            if (body_tick[i] + (end_tick >> step_level[i]) == next) active.push_back(i);
+        }
+        now = next;
+
+        pool.parallel_for(0, n, [&](int start, int end, int) {
+            ProfileScope profile(ProfilePhase::integrate);
+            for (int i = start; i < end; ++i) {
+                double dt = (now - body_tick[i]) * tick, dt2 = dt * dt, dt3 = dt2 * dt;
+                double ax = force[i].x / masses[i], ay = force[i].y / masses[i];
+                double jx = jerk[i].x / masses[i], jy = jerk[i].y / masses[i];
+                predicted_r[i].x = positions[i].x + velocities[i].x * dt + ax * dt2 / 2 + jx * dt3 / 6;
+                predicted_r[i].y = positions[i].y + velocities[i].y * dt + ay * dt2 / 2 + jy * dt3 / 6;
+                predicted_v[i].x = velocities[i].x + ax * dt + jx * dt2 / 2;
+                predicted_v[i].y = velocities[i].y + ay * dt + jy * dt2 / 2;
+            }
+        });
+
+        {
+            ProfileScope profile(ProfilePhase::forces);
+            soa.load(masses, predicted_r);
+            soa.load_velocities(predicted_v);
+            direct_sum_forces_and_jerks(soa, active, pool, G);
+            evaluations++;
+            body_evaluations += active.size();
+        }
+
+        pool.parallel_for(0, active.size(), [&](int start, int end, int) {
+            ProfileScope profile(ProfilePhase::integrate);
+            for (int k = start; k < end; ++k) {
+                int i = active[k];
+                double dt = (now - body_tick[i]) * tick, dt2 = dt * dt;
+                double inv_m = 1 / masses[i];
+                double ax0 = force[i].x * inv_m, ay0 = force[i].y * inv_m;
+                double jx0 = jerk[i].x * inv_m, jy0 = jerk[i].y * inv_m;
+                double ax1 = soa.fx[i] * inv_m, ay1 = soa.fy[i] * inv_m;
+                double jx1 = soa.jx[i] * inv_m, jy1 = soa.jy[i] * inv_m;
+                Vector2D v0 = velocities[i];
+                velocities[i].x = v0.x + (ax0 + ax1) * dt / 2 + (jx0 - jx1) * dt2 / 12;
+                velocities[i].y = v0.y + (ay0 + ay1) * dt / 2 + (jy0 - jy1) * dt2 / 12;
+                positions[i].x += (v0.x + velocities[i].x) * dt / 2 + (ax0 - ax1) * dt2 / 12;
+                positions[i].y += (v0.y + velocities[i].y) * dt / 2 + (ay0 - ay1) * dt2 / 12;
+                force[i] = Vector2D{soa.fx[i], soa.fy[i]};
+                jerk[i] = Vector2D{soa.jx[i], soa.jy[i]};
+                body_tick[i] = now;
+
+                int wanted = blockLevel(i, time_step);
+                if (wanted > step_level[i]) {
+                    step_level[i] = wanted;
+                } else if (wanted < step_level[i] && now % (end_tick >> (step_level[i] - 1)) == 0) {
+                    step_level[i]--;
+                }
+            }
+        });
+    }
+}
+
+std::vector<int> DirectSumIntegrator::levelCounts() const {
+    std::vector<int> counts;
+    for (int k : step_level) {
+        if (k >= static_cast<int>(counts.size())) counts.resize(k + 1, 0);
+        counts[k]++;
+    }
+    return counts;
+}
+
+double direct_sum_energy(const std::vector<double> &masses, const std::vector<Vector2D> &positions,
+                         const std::vector<Vector2D> &velocities, double G) {
+    double kinetic = 0, potential = 0;
+    for (size_t i = 0; i < positions.size(); ++i) {
+        kinetic += 0.5 * masses[i] * (velocities[i].x * velocities[i].x + velocities[i].y * velocities[i].y);
+        for (size_t j = i + 1; j < positions.size(); ++j) {
+            double dx = positions[j].x - positions[i].x;
+            double dy = positions[j].y - positions[i].y;
+            double dist = std::sqrt(dx * dx + dy * dy);
+            if (dist > 0) potential -= G * masses[i] * masses[j] / dist;
+        }
+    }
+    return kinetic + potential;
+}
@@ -0,0 +1,84 @@
+#ifndef INTEGRATORS_HPP
+#define INTEGRATORS_HPP
+
+#include "nbody_simulation.hpp"
+#include <string>
+#include <vector>
+
+// Time integrators of the direct-sum engine, from cheapest to most accurate per
+// step. All but euler reuse the forces computed at the end of the previous step,
+// so their cost is the number of force evaluations listed.
+//   euler     semi-implicit Euler, first order (1 evaluation)
+//   leapfrog  kick-drift-kick, second order and symplectic (1 evaluation)
+//   yoshida4  three leapfrog substeps with Yoshida's weights, fourth order and
+//             symplectic (3 evaluations)
+//   hermite4  fourth-order Hermite predictor-corrector from forces and their
+//             time derivatives (1 evaluation of the costlier jerk kernel)
+//   hermite4_block
+//             hermite4 with individual block time steps: each body steps by
+//             time_step / 2^k, with k from its acceleration over its jerk, and
+//             only the bodies due at a substep get their forces evaluated
+enum class Integrator { euler, leapfrog, yoshida4, hermite4, hermite4_block };
+
+std::string integrator_name(Integrator integrator);
+// Accepts the names above; returns false on anything else.
+bool parse_integrator(const std::string &name, Integrator &integrator);
+
+// Advances the bodies one step at a time. The forces of the current state are
+// kept between steps, so one instance must follow a single run; reset() after
+// changing the bodies by other means.
+class DirectSumIntegrator {
+public:
+    DirectSumIntegrator(Integrator method, ThreadPool &pool, double G = 6.67430e-11);
+
+    // Afterwards forces holds the forces at the new positions (at the old ones
+    // for euler, which evaluates them first).
+    void step(const std::vector<double> &masses, std::vector<Vector2D> &positions, std::vector<Vector2D> &velocities,
+              std::vector<Vector2D> &forces, double time_step);
+    void reset() {
+        primed = false;
+        step_level.clear();
+    }
+
+    Integrator method() const { return integrator; }
+    // Force passes so far: all-pairs evaluations, and for hermite4_block one per
+    // block substep, over only the bodies due at it.
+    size_t forceEvaluations() const { return evaluations; }
+    // Forces computed on single bodies so far; the cost measure across methods,
+    // since hermite4_block only evaluates some of the bodies at a time.
+    size_t bodyForceEvaluations() const { return body_evaluations; }
+    // Bodies on each time step level k (step time_step / 2^k), for hermite4_block.
+    std::vector<int> levelCounts() const;
+
+private:
+    void evaluate(const std::vector<double> &masses, const std::vector<Vector2D> &positions, const std::vector<Vector2D> &velocities);
+    void leapfrog(const std::vector<double> &masses, std::vector<Vector2D> &positions, std::vector<Vector2D> &velocities, double time_step);
+    void hermite(const std::vector<double> &masses, std::vector<Vector2D> &positions, std::vector<Vector2D> &velocities, double time_step);
+    void blockHermite(const std::vector<double> &masses, std::vector<Vector2D> &positions, std::vector<Vector2D> &velocities, double time_step);
+    int blockLevel(size_t i, double time_step) const;
+
+    Integrator integrator;
+    ThreadPool &pool;
+    double G;
+    SimdLevel level;
+    BodiesSoA soa;
+    bool primed = false;
+    size_t evaluations = 0;
+    size_t body_evaluations = 0;
+    std::vector<Vector2D> force, jerk; // At the current state
+    std::vector<Vector2D> r0, v0, force0, jerk0; // Hermite's start of step
+
+    // hermite4_block: each body's step level and the tick it was last advanced
+    // to, a tick being time_step / 2^max_block_level
+    double block_step = 0;
+    std::vector<int> step_level;
+    std::vector<uint64_t> body_tick;
+    std::vector<int> active;
+    std::vector<Vector2D> predicted_r, predicted_v;
+};
+
+// Kinetic plus potential energy, summed over all pairs.
+double direct_sum_energy(const std::vector<double> &masses, const std::vector<Vector2D> &positions,
+                         const std::vector<Vector2D> &velocities, double G = 6.67430e-11);
+
+#endif // INTEGRATORS_HPP
@@ -0,0 +1,229 @@
+#include "linear_quadtree.hpp"
+#include "bounding_box.hpp"
+#include <algorithm>
+#include <cmath>
+
+// Spreads the low 32 bits of x so that bit k lands on bit 2k.
+static uint64_t spreadBits(uint64_t x) {
+    x &= 0xffffffffULL;
+    x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | (x << 2)) & 0x3333333333333333ULL;
+    x = (x | (x << 1)) & 0x5555555555555555ULL;
+    return x;
+}
+
+void LinearQuadtree::build(const Scenario &bodies, int leaf_size) {
+    this->leaf_size = std::max(1, leaf_size);
+    int n = bodies.r.size();
+    nodes.clear();
+    if (n == 0) return;
+
+    BoundingSquare<Vector2D> box = bounding_square(bodies.r);
+    double size = box.size;
+    double min_x = box.center.x - size / 2;
+    double min_y = box.center.y - size / 2;
+
+    const double cells = double(1ULL << max_depth);
+    const uint64_t max_cell = (1ULL << max_depth) - 1;
+    keys.resize(n);
+    order.resize(n);
+    for (int i = 0; i < n; ++i) {
+        uint64_t qx = std::min(max_cell, uint64_t((bodies.r[i].x - min_x) / size * cells));
+        uint64_t qy = std::min(max_cell, uint64_t((bodies.r[i].y - min_y) / size * cells));
+        keys[i] = (spreadBits(qy) << 1) | spreadBits(qx);
+        order[i] = i;
+    }
+    radixSort();
+
+    sorted_r.resize(n);
+    sorted_m.resize(n);
+    for (int s = 0; s < n; ++s) {
+        sorted_r[s] = bodies.r[order[s]];
+        sorted_m[s] = bodies.m[order[s]];
+    }
+
+    nodes.reserve(2 * n);
+    buildNode(0, n, 0, size);
+}
+
+// LSD radix sort of (key, body) pairs, one byte per pass. Passes whose digit
+// is the same for every key are skipped.
+void LinearQuadtree::radixSort() {
+    int n = keys.size();
+    keys_tmp.resize(n);
+    order_tmp.resize(n);
+    for (int shift = 0; shift < 2 * max_depth; shift += 8) {
+        int count[257] = {0};
+        for (int i = 0; i < n; ++i) count[((keys[i] >> shift) & 0xff) + 1]++;
+        if (count[((keys[0] >> shift) & 0xff) + 1] == n) continue;
+        for (int d = 0; d < 256; ++d) count[d + 1] += count[d];
+        for (int i = 0; i < n; ++i) {
+            int pos = count[(keys[i] >> shift) & 0xff]++;
+            keys_tmp[pos] = keys[i];
+            order_tmp[pos] = order[i];
+        }
+        keys.swap(keys_tmp);
+        order.swap(order_tmp);
+    }
+}
+
+// Emits the node for sorted bodies [first, last), which share their first
+// `level` quadrant digits, followed by its subtree. Returns its index.
+int LinearQuadtree::buildNode(int first, int last, int level, double size) {
+    int index = nodes.size();
+    nodes.push_back(LinearNode{0, Vector2D{0, 0}, size, 0, first, last - first, false});
+
+    double m = 0;
+    Vector2D weighted{0, 0};
+    if (last - first <= leaf_size || level == max_depth) {
+        for (int b = first; b < last; ++b) {
+            m += sorted_m[b];
+            weighted += sorted_r[b] * sorted_m[b];
+        }
+        nodes[index].is_leaf = true;
+    } else {
+        int shift = 2 * (max_depth - 1 - level);
+        int begin = first;
+        while (begin < last) {
+            uint64_t digit = (keys[begin] >> shift) & 3;
+            int end = std::partition_point(keys.begin() + begin, keys.begin() + last,
+                                           [&](uint64_t key) { return ((key >> shift) & 3) == digit; }) -
+                      keys.begin();
+            int child = buildNode(begin, end, level + 1, size / 2);
+            m += nodes[child].m;
+            weighted += nodes[child].center_of_mass * nodes[child].m;
+            begin = end;
+        }
+    }
+
+    nodes[index].m = m;
+    nodes[index].center_of_mass = m > 0 ? weighted / m : sorted_r[first];
+    nodes[index].next = nodes.size();
+    return index;
+}
+
+void barnes_hut_update_step_linear(Scenario &bodies, LinearQuadtree &tree, double time_step, int leaf_size) {
+    tree.build(bodies, leaf_size);
+
+    // Initialize forces to zero
+    bodies.f.assign(bodies.r.size(), Vector2D{0.0, 0.0});
+
+    // Walking bodies in Morton order keeps consecutive walks on the same nodes
+    const std::vector<int> &order = tree.bodyOrder();
+    for (size_t s = 0; s < order.size(); s++) {
+        const int i = order[s];
+        const double m = bodies.m[i];
+        const Vector2D r = bodies.r[i];
+
+        tree.walk(s, [&](const Vector2D &other_r, const double other_m) {
+            Vector2D dr = other_r - r;
+            double dist_sq = std::max(dr.norm2(), 1e-6);  // Avoid division by zero
+            double dist = std::sqrt(dist_sq);
+            if (dist > 1e-6) {  // Avoid very small distances causing large forces
+                double force_mag = G * other_m * m / dist_sq;
+                Vector2D force = dr * (force_mag / dist);
+                bodies.f[i] += force;  // Store the force
+                bodies.v[i] += force * (time_step / m);
+            }
+        });
+    }
+
+    /* Update positions */
+    for (size_t i = 0; i < bodies.r.size(); i++) {
+        bodies.r[i] += bodies.v[i] * time_step;
+    }
+}
+
+// Cell acceptance for a whole group: uses the distance from the cell's center
+// of mass to the nearest point of the group's bounding box.
+static bool isFarEnoughFromGroup(const LinearNode &node, const Vector2D &low, const Vector2D &high) {
+    double dx = std::max(0.0, std::max(low.x - node.center_of_mass.x, node.center_of_mass.x - high.x));
+    double dy = std::max(0.0, std::max(low.y - node.center_of_mass.y, node.center_of_mass.y - high.y));
+    double dist_sq = std::max(dx * dx + dy * dy, 1e-6);
+    return node.size * node.size / dist_sq < theta * theta;
+}
+
+static void buildInteractionList(const LinearQuadtree &tree, int group, InteractionList &list) {
+    const std::vector<LinearNode> &nodes = tree.getNodes();
+    const std::vector<Vector2D> &r = tree.sortedPositions();
+    const std::vector<double> &m = tree.sortedMasses();
+    const LinearNode &g = nodes[group];
+    int group_end = g.first_body + g.num_bodies;
+
+    Vector2D low = r[g.first_body], high = r[g.first_body];
+    for (int b = g.first_body; b < group_end; ++b) {
+        low.x = std::min(low.x, r[b].x);
+        low.y = std::min(low.y, r[b].y);
+        high.x = std::max(high.x, r[b].x);
+        high.y = std::max(high.y, r[b].y);
+    }
+
+    list.clear();
+    int k = 0;
+    int num_nodes = nodes.size();
+    while (k < num_nodes) {
+        const LinearNode &node = nodes[k];
+        int node_end = node.first_body + node.num_bodies;
+        bool contains_group = node.first_body <= g.first_body && group_end <= node_end;
+        if (k == group || (node.is_leaf && !contains_group)) {
+            for (int b = node.first_body; b < node_end; ++b) list.push(r[b], m[b], b);
+            k = node.next;
+        } else if (!contains_group && isFarEnoughFromGroup(node, low, high)) {
+            list.push(node.center_of_mass, node.m, -1);
+            k = node.next;
+        } else {
+            ++k;
+        }
+    }
+}
+
+void barnes_hut_update_step_group(Scenario &bodies, LinearQuadtree &tree, InteractionList &list, double time_step, int group_size, int leaf_size) {
+    tree.build(bodies, leaf_size);
+    const std::vector<LinearNode> &nodes = tree.getNodes();
+    const std::vector<Vector2D> &sorted_r = tree.sortedPositions();
+    const std::vector<int> &order = tree.bodyOrder();
+
+    bodies.f.assign(bodies.r.size(), Vector2D{0.0, 0.0});
+
+    int k = 0;
+    int num_nodes = nodes.size();
+    while (k < num_nodes) {
+        const LinearNode &group = nodes[k];
+        if (!group.is_leaf && group.num_bodies > group_size) {
+            ++k;
+            continue;
+        }
+
+        buildInteractionList(tree, k, list);
+        const double *x = list.x.data();
+        const double *y = list.y.data();
+        const double *m = list.m.data();
+        const int *id = list.id.data();
+        int count = list.x.size();
+
+        for (int s = group.first_body; s < group.first_body + group.num_bodies; ++s) {
+            const double rx = sorted_r[s].x, ry = sorted_r[s].y;
+            double ax = 0, ay = 0;
+            for (int j = 0; j < count; ++j) {
+                double dx = x[j] - rx;
+                double dy = y[j] - ry;
+                double dist_sq = std::max(dx * dx + dy * dy, 1e-6);  // Avoid division by zero
+                double scale = id[j] == s ? 0.0 : m[j] / (dist_sq * std::sqrt(dist_sq));
+                ax += scale * dx;
+                ay += scale * dy;
+            }
+            const int i = order[s];
+            Vector2D force = Vector2D{ax, ay} * (G * bodies.m[i]);
+            bodies.f[i] += force;
+            bodies.v[i] += force * (time_step / bodies.m[i]);
+        }
+        k = group.next;
+    }
+
+    /* Update positions */
+    for (size_t i = 0; i < bodies.r.size(); i++) {
+        bodies.r[i] += bodies.v[i] * time_step;
+    }
+}
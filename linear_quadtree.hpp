@@ -0,0 +1,115 @@
+#ifndef LINEAR_QUADTREE_HPP
+#define LINEAR_QUADTREE_HPP
+
+#include "nbody_simulation2.hpp"
+#include "barnes_hut.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Node of the linear quadtree. Nodes are stored in depth-first pre-order, so
+// the first child of a node is the next entry and `next` skips the whole
+// subtree; the force walk needs no stack and no child pointers.
+struct LinearNode {
+    double m;
+    Vector2D center_of_mass;
+    double size;      // side length of the square cell
+    int next;         // index of the first node after this subtree
+    int first_body;   // offset into the Morton-sorted bodies
+    int num_bodies;   // bodies in the subtree
+    bool is_leaf;
+};
+
+// Barnes-Hut tree built from Morton (Z-order) keys: bodies are quantized on a
+// 2^max_depth grid over their bounding square, radix-sorted by key, and the
+// node array is emitted in one recursive pass over the sorted keys.
+class LinearQuadtree {
+public:
+    static const int max_depth = 30;
+
+    // Cells with at most leaf_size bodies are not split further.
+    void build(const Scenario &bodies, int leaf_size = 1);
+
+    // Bodies in Morton order: sorted position `s` holds original body order[s]
+    const std::vector<int> &bodyOrder() const { return order; }
+    const std::vector<LinearNode> &getNodes() const { return nodes; }
+    const std::vector<Vector2D> &sortedPositions() const { return sorted_r; }
+    const std::vector<double> &sortedMasses() const { return sorted_m; }
+
+    // Calls interact(r, m) for every body or cell acting on sorted body `s`
+    template <typename Interact>
+    void walk(int s, Interact interact) const;
+
+private:
+    int buildNode(int first, int last, int level, double size);
+    void radixSort();
+
+    std::vector<LinearNode> nodes;
+    std::vector<uint64_t> keys, keys_tmp;
+    std::vector<int> order, order_tmp;
+    std::vector<Vector2D> sorted_r;
+    std::vector<double> sorted_m;
+    int leaf_size = 1;
+};
+
+inline bool isFarEnough(const LinearNode &node, const Vector2D &point) {
+    Vector2D dr = node.center_of_mass - point;
+    double dist_sq = std::max(dr.norm2(), 1e-6);
+    return node.size * node.size / dist_sq < theta * theta;
+}
+
+template <typename Interact>
+void LinearQuadtree::walk(int s, Interact interact) const {
+    const Vector2D &r = sorted_r[s];
+    int k = 0;
+    int num_nodes = nodes.size();
+    while (k < num_nodes) {
+        const LinearNode &node = nodes[k];
+        if (node.is_leaf) {
+            for (int b = node.first_body; b < node.first_body + node.num_bodies; ++b) {
+                if (b != s) interact(sorted_r[b], sorted_m[b]);
+            }
+            k = node.next;
+        } else if (isFarEnough(node, r)) {
+            interact(node.center_of_mass, node.m);
+            k = node.next;
+        } else {
+            ++k;
+        }
+    }
+}
+
+// Builds the tree with leaves of up to leaf_size bodies, then walks it once
+// per body.
+void barnes_hut_update_step_linear(Scenario &bodies, LinearQuadtree &tree, double time_step, int leaf_size = 1);
+
+// Cells and bodies that act on one group, in structure-of-arrays layout so the
+// evaluation loop over them vectorizes. `id` is the Morton-sorted index of a
+// body, or -1 for a cell.
+struct InteractionList {
+    std::vector<double> x, y, m;
+    std::vector<int> id;
+
+    void clear() {
+        x.clear();
+        y.clear();
+        m.clear();
+        id.clear();
+    }
+    void push(const Vector2D &r, double mass, int index) {
+        x.push_back(r.x);
+        y.push_back(r.y);
+        m.push_back(mass);
+        id.push_back(index);
+    }
+};
+
+// Group walk: every cell holding at most group_size bodies walks the tree once
+// for all of them. A cell is accepted when it is far enough from the group's
+// bounding box, so the decision holds for every member, and the resulting
+// interaction list is then evaluated for each member in a tight loop. Leaves
+// hold up to leaf_size bodies, and each is a group even above group_size.
+void barnes_hut_update_step_group(Scenario &bodies, LinearQuadtree &tree, InteractionList &list, double time_step, int group_size = 32,
+                                  int leaf_size = 1);
+
+#endif // LINEAR_QUADTREE_HPP
@@ -0,0 +1,32 @@
+#ifndef LOG_HPP
+#define LOG_HPP
+
+#include <iostream>
+
+// Compile-time log levels. Messages above NBODY_LOG_LEVEL sit behind a
+// constant-false branch, so the compiler drops them together with the
+// formatting of their arguments. Build with -DNBODY_LOG_LEVEL=4 to trace every
+// body, or 0 to silence the engine entirely.
+#define NBODY_LOG_LEVEL_OFF 0
+#define NBODY_LOG_LEVEL_ERROR 1
+#define NBODY_LOG_LEVEL_INFO 2
+#define NBODY_LOG_LEVEL_DEBUG 3
+#define NBODY_LOG_LEVEL_TRACE 4
+
+#ifndef NBODY_LOG_LEVEL
+#define NBODY_LOG_LEVEL NBODY_LOG_LEVEL_INFO
+#endif
+
+#define NBODY_LOG(level, stream, message)       \
+    do {                                        \
+        if ((level) <= NBODY_LOG_LEVEL) {       \
+            stream << message;                  \
+        }                                       \
+    } while (0)
+
+#define LOG_ERROR(message) NBODY_LOG(NBODY_LOG_LEVEL_ERROR, std::cerr, "Error: " << message << "\n")
+#define LOG_INFO(message) NBODY_LOG(NBODY_LOG_LEVEL_INFO, std::cout, message << "\n")
+#define LOG_DEBUG(message) NBODY_LOG(NBODY_LOG_LEVEL_DEBUG, std::cout, message << "\n")
+#define LOG_TRACE(message) NBODY_LOG(NBODY_LOG_LEVEL_TRACE, std::cout, message << "\n")
+
+#endif // LOG_HPP
@@ -12,10 +12,11 @@ int main() {
     gather_input(n, masses, positions, velocities, time_step, total_time);
 
     std::vector<Vector2D> forces(n);
+    ThreadPool pool;
 
     for (double t = 0; t < total_time; t += time_step) {
-        compute_forces(n, masses, positions, forces);
-        update_bodies(n, masses, positions, velocities, forces, time_step);
+        compute_forces(n, masses, positions, forces, pool);
+        update_bodies(n, masses, positions, velocities, forces, time_step, pool);
         // Optional: Output positions or other details here for visualization or debugging
     }
 
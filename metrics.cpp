@@ -0,0 +1,48 @@
+#include "metrics.hpp"
+#include <algorithm>
+
+void WalkCounters::add(const WalkCounters &other) {
+    node_visits += other.node_visits;
+    body_body += other.body_body;
+    body_cell += other.body_cell;
+    max_depth = std::max(max_depth, other.max_depth);
+}
+
+Metrics::Metrics(int num_threads) : threads(num_threads > 0 ? num_threads : 1) {}
+
+void Metrics::beginStep() {
+    std::fill(threads.begin(), threads.end(), WalkCounters());
+    step = StepMetrics();
+}
+
+const StepMetrics &Metrics::endStep() {
+    for (const WalkCounters &counters : threads) step.counters.add(counters);
+    history.push_back(step);
+    return history.back();
+}
+
+StepMetrics Metrics::total() const {
+    StepMetrics sum;
+    for (const StepMetrics &s : history) {
+        sum.build_seconds += s.build_seconds;
+        sum.walk_seconds += s.walk_seconds;
+        sum.integrate_seconds += s.integrate_seconds;
+        sum.counters.add(s.counters);
+    }
+    return sum;
+}
+
+static void write_row(std::ostream &out, const StepMetrics &s) {
+    out << "build " << s.build_seconds << " s, walk " << s.walk_seconds << " s, integrate " << s.integrate_seconds
+        << " s, node visits " << s.counters.node_visits << ", body-body " << s.counters.body_body
+        << ", body-cell " << s.counters.body_cell << ", max depth " << s.counters.max_depth << "\n";
+}
+
+void Metrics::dump(std::ostream &out, bool per_step) const {
+    for (size_t i = 0; per_step && i < history.size(); ++i) {
+        out << "Step " << (i + 1) << ": ";
+        write_row(out, history[i]);
+    }
+    out << "Total over " << history.size() << " steps: ";
+    write_row(out, total());
+}
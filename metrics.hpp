@@ -0,0 +1,61 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include "aligned_allocator.hpp"
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Counters one thread accumulates during the force walk. Each thread owns one
+// slot, padded to a cache line so that neighbouring threads do not share it.
+struct alignas(64) WalkCounters {
+    uint64_t node_visits = 0;
+    uint64_t body_body = 0; // Interactions with single bodies in a leaf
+    uint64_t body_cell = 0; // Interactions with the centre of mass of a far cell
+    int max_depth = 0; // Deepest leaf reached
+
+    void add(const WalkCounters &other);
+};
+
+// Totals of one time step.
+struct StepMetrics {
+    double build_seconds = 0;
+    double walk_seconds = 0;
+    double integrate_seconds = 0;
+    WalkCounters counters;
+
+    size_t interactions() const { return counters.body_body + counters.body_cell; }
+};
+
+// Collects the per-thread counters of every time step of a run. A step goes
+// beginStep(), the phases filling thread(id) and the phase times, endStep().
+class Metrics {
+public:
+    explicit Metrics(int num_threads);
+
+    void beginStep();
+    WalkCounters &thread(int thread_id) { return threads[thread_id]; }
+    StepMetrics &current() { return step; }
+    // Folds the thread counters into the step and keeps it.
+    const StepMetrics &endStep();
+
+    const std::vector<StepMetrics> &steps() const { return history; }
+    StepMetrics total() const;
+
+    // The totals of the run, preceded by one line per step if per_step is set.
+    void dump(std::ostream &out, bool per_step = true) const;
+
+private:
+    // Over-aligned, so std::allocator would not place it on a cache line
+    std::vector<WalkCounters, AlignedAllocator<WalkCounters, alignof(WalkCounters)>> threads;
+    StepMetrics step;
+    std::vector<StepMetrics> history;
+};
+
+// Seconds since start, for timing a phase.
+inline double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+#endif // METRICS_HPP
@@ -1,14 +1,12 @@
 #include "nbody_simulation.hpp"
+#include "integrators.hpp"
 #include <iostream>
 #include <cmath>
 #include <vector>
-#include <thread>
-#include <mutex>
+#include <algorithm>
 #include <Magick++.h>
 using namespace Magick;
 
-std::mutex force_mutex;
-
 void gather_input(int &n, std::vector<double> &masses, std::vector<Vector2D> &positions, std::vector<Vector2D> &velocities, double &time_step, double &total_time) {
     std::cout << "Enter the number of bodies to simulate: ";
     std::cin >> n;
@@ -35,50 +33,123 @@ void gather_input(int &n, std::vector<double> &masses, std::vector<Vector2D> &po
         std::cin >> velocities[i].y;
     }
 
+    gather_run_settings(time_step, total_time);
+}
+
+void gather_run_settings(double &time_step, double &total_time) {
     std::cout << "Enter the time step for the simulation (seconds): ";
     std::cin >> time_step;
     std::cout << "Enter the total simulation time (seconds): ";
     std::cin >> total_time;
 }
 
-void compute_forces_segment(const int n, const std::vector<double>& masses, const std::vector<Vector2D>& positions, std::vector<Vector2D>& forces, int start, int end, double G) {
-    for (int i = start; i < end; ++i) {
-        Vector2D force = {0, 0};
-        for (int j = i + 1; j < n; ++j) {
-            Vector2D delta = {positions[j].x - positions[i].x, positions[j].y - positions[i].y};
-            double dist_squared = delta.x * delta.x + delta.y * delta.y;
-            double dist = std::sqrt(dist_squared);
-            double force_magnitude = G * masses[i] * masses[j] / dist_squared;
-            Vector2D force_ij = {force_magnitude * delta.x / dist, force_magnitude * delta.y / dist};
-
-            std::lock_guard<std::mutex> lock(force_mutex);
-            forces[i].x += force_ij.x;
-            forces[i].y += force_ij.y;
-            forces[j].x -= force_ij.x; 
-            forces[j].y -= force_ij.y; 
+// A tile of the i<j triangle: every pair (i, j) with i in [i_begin, i_end),
+// j in [j_begin, j_end) and i < j. Diagonal tiles hold roughly half the pairs
+// of the others, which is accounted for when tiles are shared among threads.
+struct ForceTile {
+    int i_begin, i_end, j_begin, j_end;
+    long long cost;
+};
+
+std::vector<ForceTile> make_triangle_tiles(int n, int num_blocks) {
+    std::vector<ForceTile> tiles;
+    int block_size = (n + num_blocks - 1) / num_blocks;
+    for (int bi = 0; bi * block_size < n; ++bi) {
+        int i_begin = bi * block_size;
+        int i_end = std::min(i_begin + block_size, n);
+        for (int bj = bi; bj * block_size < n; ++bj) {
+            int j_begin = bj * block_size;
+            int j_end = std::min(j_begin + block_size, n);
+            long long rows = i_end - i_begin;
+            long long cols = j_end - j_begin;
+            long long cost = (bi == bj) ? rows * (rows - 1) / 2 : rows * cols;
+            if (cost > 0) {
+                tiles.push_back(ForceTile{i_begin, i_end, j_begin, j_end, cost});
+            }
+        }
+    }
+    return tiles;
+}
+
+// Accumulates the pair forces of tiles [tile_begin, tile_end) into this thread's
+// own buffer, using Newton's third law so each pair is evaluated once.
+void compute_forces_segment(const std::vector<double>& masses, const std::vector<Vector2D>& positions, const std::vector<ForceTile>& tiles, int tile_begin, int tile_end, std::vector<Vector2D>& local_forces, double G) {
+    local_forces.assign(positions.size(), Vector2D{0, 0});
+    for (int t = tile_begin; t < tile_end; ++t) {
+        const ForceTile& tile = tiles[t];
+        for (int i = tile.i_begin; i < tile.i_end; ++i) {
+            Vector2D force = {0, 0};
+            for (int j = std::max(tile.j_begin, i + 1); j < tile.j_end; ++j) {
+                Vector2D delta = {positions[j].x - positions[i].x, positions[j].y - positions[i].y};
+                double dist_squared = delta.x * delta.x + delta.y * delta.y;
+                double dist = std::sqrt(dist_squared);
+                double force_magnitude = G * masses[i] * masses[j] / dist_squared;
+                Vector2D force_ij = {force_magnitude * delta.x / dist, force_magnitude * delta.y / dist};
+
+                force.x += force_ij.x;
+                force.y += force_ij.y;
+                local_forces[j].x -= force_ij.x;
+                local_forces[j].y -= force_ij.y;
+            }
+            local_forces[i].x += force.x;
+            local_forces[i].y += force.y;
+        }
+    }
+}
+
+void reduce_forces_segment(const std::vector<std::vector<Vector2D>>& local_forces, std::vector<Vector2D>& forces, int start, int end) {
+    for (size_t k = 0; k < local_forces.size(); ++k) {
+        const std::vector<Vector2D>& local = local_forces[k];
+        for (int i = start; i < end; ++i) {
+            forces[i].x += local[i].x;
+            forces[i].y += local[i].y;
         }
     }
 }
 
-void compute_forces(const int n, const std::vector<double>& masses, const std::vector<Vector2D>& positions, std::vector<Vector2D>& forces, double G) {
+void compute_forces(const int n, const std::vector<double>& masses, const std::vector<Vector2D>& positions, std::vector<Vector2D>& forces, ThreadPool& pool, double G) {
     forces.assign(n, Vector2D{0, 0});
-    int num_threads = std::thread::hardware_concurrency();
+    int num_threads = pool.size();
+
+    // Several blocks per thread so the tiles can be dealt out in equal-cost shares
+    std::vector<ForceTile> tiles = make_triangle_tiles(n, std::max(1, std::min(n, 4 * num_threads)));
+    long long total_cost = 0;
+    for (const ForceTile& tile : tiles) total_cost += tile.cost;
+
+    std::vector<int> tile_split(num_threads + 1, static_cast<int>(tiles.size()));
+    tile_split[0] = 0;
+    long long cost = 0;
+    int next = 1;
+    for (size_t t = 0; t < tiles.size() && next < num_threads; ++t) {
+        cost += tiles[t].cost;
+        while (next < num_threads && cost * num_threads >= total_cost * next) {
+            tile_split[next++] = t + 1;
+        }
+    }
+
+    std::vector<std::vector<Vector2D>> local_forces(num_threads);
     int chunk_size = (n + num_threads - 1) / num_threads;
-    std::vector<std::thread> threads;
+    pool.run([&](int thread_id) {
+        ProfileScope profile(ProfilePhase::forces);
+        compute_forces_segment(masses, positions, tiles, tile_split[thread_id], tile_split[thread_id + 1], local_forces[thread_id], G);
+        pool.barrier();
 
-    for (int i = 0; i < num_threads; ++i) {
-        int start = i * chunk_size;
+        int start = thread_id * chunk_size;
         int end = std::min(start + chunk_size, n);
         if (start < end) {
-            threads.emplace_back(compute_forces_segment, n, std::ref(masses), std::ref(positions), std::ref(forces), start, end, G);
+            reduce_forces_segment(local_forces, forces, start, end);
         }
-    }
+    });
+}
 
-    for (auto& t : threads) {
-        if (t.joinable()) {
-            t.join();
-        }
-    }
+// Same forces as compute_forces, evaluated by the vectorized all-pairs kernel on
+// a structure-of-arrays copy of the bodies.
+void compute_forces_simd(const int n, const std::vector<double>& masses, const std::vector<Vector2D>& positions, std::vector<Vector2D>& forces, BodiesSoA& soa, ThreadPool& pool, double G) {
+    static const SimdLevel level = detect_simd_level();
+    ProfileScope profile(ProfilePhase::forces);
+    soa.load(masses, positions);
+    direct_sum_forces(soa, pool, G, level);
+    soa.store_forces(forces);
 }
 
 void update_bodies_segment(int n, std::vector<double>& masses, std::vector<Vector2D>& positions, std::vector<Vector2D>& velocities, std::vector<Vector2D>& forces, double time_step, int start, int end) {
@@ -90,27 +161,14 @@ void update_bodies_segment(int n, std::vector<double>& masses, std::vector<Vecto
     }
 }
 
-void update_bodies(int n, std::vector<double>& masses, std::vector<Vector2D>& positions, std::vector<Vector2D>& velocities, std::vector<Vector2D>& forces, double time_step) {
-    int num_threads = std::thread::hardware_concurrency();
-    int chunk_size = (n + num_threads - 1) / num_threads;
-    std::vector<std::thread> threads;
-
-    for (int i = 0; i < num_threads; ++i) {
-        int start = i * chunk_size;
-        int end = std::min(start + chunk_size, n);
-        if (start < end) {
-            threads.emplace_back(update_bodies_segment, n, std::ref(masses), std::ref(positions), std::ref(velocities), std::ref(forces), time_step, start, end);
-        }
-    }
-
-    for (auto& t : threads) {
-        if (t.joinable()) {
-            t.join();
-        }
-    }
+void update_bodies(int n, std::vector<double>& masses, std::vector<Vector2D>& positions, std::vector<Vector2D>& velocities, std::vector<Vector2D>& forces, double time_step, ThreadPool& pool) {
+    pool.parallel_for(0, n, [&](int start, int end, int) {
+        ProfileScope profile(ProfilePhase::integrate);
+        update_bodies_segment(n, masses, positions, velocities, forces, time_step, start, end);
+    });
 }
 
-void draw_arrow(Magick::Image &frame, int x1, int y1, double dx, double dy, const std::string &color) {
+void draw_arrow(Framebuffer &frame, int x1, int y1, double dx, double dy, Rgba color) {
     double angle = std::atan2(dy, dx);
     const double arrow_length = 15;
     const double arrow_angle = M_PI / 6; // 30 degrees for each arrowhead wing
@@ -123,19 +181,16 @@ void draw_arrow(Magick::Image &frame, int x1, int y1, double dx, double dy, cons
     int x4 = x2 - static_cast<int>(arrow_length/3 * std::cos(angle + arrow_angle));
     int y4 = y2 - static_cast<int>(arrow_length/3 * std::sin(angle + arrow_angle));
 
-    frame.strokeColor(color);
-
-    frame.draw(Magick::DrawableLine(x1, y1, x2, y2));
-    frame.draw(Magick::DrawableLine(x2, y2, x3, y3));
-    frame.draw(Magick::DrawableLine(x2, y2, x4, y4));
+    frame.drawLine(x1, y1, x2, y2, color, 2);
+    frame.drawLine(x2, y2, x3, y3, color, 2);
+    frame.drawLine(x2, y2, x4, y4, color, 2);
 }
 
-void save_frame(const std::vector<Vector2D>& positions, const std::vector<Vector2D>& velocities, const std::vector<Vector2D>& forces, int n, int t, std::vector<Magick::Image>& frames, double min_x, double max_x, double min_y, double max_y) {
-    int width = 800;
-    int height = 800;
-    Magick::Image frame(Magick::Geometry(width, height), "white");
-    frame.strokeWidth(2);
-    std::vector<std::string> colors = {"red", "green", "blue", "yellow", "cyan", "magenta", "orange", "purple", "brown", "pink"};
+void save_frame(const std::vector<Vector2D>& positions, const std::vector<Vector2D>& velocities, const std::vector<Vector2D>& forces, int n, Framebuffer &frame, double min_x, double max_x, double min_y, double max_y) {
+    int width = frame.width();
+    int height = frame.height();
+    frame.clear(colors::white);
+    const std::vector<Rgba> palette = {colors::red, colors::green, colors::blue, colors::yellow, colors::cyan, colors::magenta, colors::orange, colors::purple, colors::brown, colors::pink};
 
     double range_x = max_x - min_x;
     double range_y = max_y - min_y;
@@ -144,44 +199,52 @@ void save_frame(const std::vector<Vector2D>& positions, const std::vector<Vector
         int x = ((positions[i].x - min_x) / range_x) * width;
         int y = height - ((positions[i].y - min_y) / range_y) * height;
 
-        frame.fillColor(colors[i % colors.size()]);
-        frame.strokeColor("black");
-        frame.draw(Magick::DrawableCircle(x, y, x + 3, y + 3));
+        // Filled disc of radius ~4 with a 2 pixel black outline
+        frame.fillCircle(x, y, 5, colors::black);
+        frame.fillCircle(x, y, 3, palette[i % palette.size()]);
 
         double vx = (velocities[i].x / range_x) * width;
         double vy = -(velocities[i].y / range_y) * height; // Negative because the y-axis is inverted in the image
         double Fx = (forces[i].x / range_x) * width;
         double Fy = -(forces[i].y / range_y) * height; // Negative because the y-axis is inverted in the image
 
-        frame.fillColor("none"); // Reset fill color before drawing arrows
-        draw_arrow(frame, x, y, vx, vy, colors[i % colors.size()]); // velocities are in the color of the object
+        draw_arrow(frame, x, y, vx, vy, palette[i % palette.size()]); // velocities are in the color of the object
         if (n > 1) {
-            for (const auto& force : forces) {
-                draw_arrow(frame, x, y, Fx, Fy, "black"); // forces are in color black
-            }
+            draw_arrow(frame, x, y, Fx, Fy, colors::black); // forces are in color black
         }
     }
+}
+
+Magick::Image frame_to_image(const Framebuffer &buffer, int t, double min_x, double max_x, double min_y, double max_y) {
+    Magick::Image frame(buffer.width(), buffer.height(), "RGBA", Magick::CharPixel, buffer.data());
     frame.strokeColor("black");
     std::string border_info = "Time: " + std::to_string(t) + 
                               "\nRange: [" + std::to_string(min_x) + ", " + std::to_string(max_x) + "] x " +
                               "[" + std::to_string(min_y) + ", " + std::to_string(max_y) + "]";
     frame.annotate(border_info, Magick::NorthWestGravity);
-    frames.push_back(frame);
+    return frame;
 }
 
-void visualize(const std::vector<std::vector<Vector2D>>& all_positions, const std::vector<std::vector<Vector2D>>& all_velocities, const std::vector<std::vector<Vector2D>>& all_forces, int n, double time_step, double total_time) {
+void visualize(const TrajectoryReader &trajectory, ThreadPool &pool) {
     Magick::InitializeMagick(nullptr);
     std::vector<Magick::Image> frames;
-    double min_x = all_positions[0][0].x;
-    double max_x = all_positions[0][0].x;
-    double min_y = all_positions[0][0].y;
-    double max_y = all_positions[0][0].y;
-    for (const auto& positions_at_time : all_positions) {
-        for (const auto& pos : positions_at_time) {
-            if (pos.x < min_x) min_x = pos.x;
-            if (pos.x > max_x) max_x = pos.x;
-            if (pos.y < min_y) min_y = pos.y;
-            if (pos.y > max_y) max_y = pos.y;
+    if (trajectory.numFrames() == 0 || trajectory.numBodies() == 0) {
+        std::cerr << "Error: No positions available for visualization\n";
+        return;
+    }
+    int n = trajectory.numBodies();
+    double min_x = trajectory.component(0, 0)[0];
+    double max_x = min_x;
+    double min_y = trajectory.component(0, 1)[0];
+    double max_y = min_y;
+    for (size_t frame = 0; frame < trajectory.numFrames(); ++frame) {
+        const double *x = trajectory.component(frame, 0);
+        const double *y = trajectory.component(frame, 1);
+        for (int i = 0; i < n; ++i) {
+            if (x[i] < min_x) min_x = x[i];
+            if (x[i] > max_x) max_x = x[i];
+            if (y[i] < min_y) min_y = y[i];
+            if (y[i] > max_y) max_y = y[i];
         }
     }
 
@@ -192,41 +255,100 @@ void visualize(const std::vector<std::vector<Vector2D>>& all_positions, const st
     min_y -= margin_y;
     max_y += margin_y;
 
-    for (double t = 0; t < total_time; t += time_step) {
-        save_frame(all_positions[t], all_velocities[t], all_forces[t], n, t*time_step, frames, min_x, max_x, min_y, max_y);
+    // Frames are rasterized in batches, several at once on the pool, and then
+    // handed to Magick in order
+    size_t num_frames = trajectory.numFrames();
+    size_t batch_size = 2 * pool.size();
+    std::vector<Framebuffer> buffers(batch_size);
+    if (trajectory.numBodies() > density_threshold) {
+        // One frame at a time, each binned by the whole pool
+        DensityRenderer density(pool);
+        for (size_t frame = 0; frame < num_frames; ++frame) {
+            density.render(buffers[0], trajectory.component(frame, 0), trajectory.component(frame, 1), nullptr, n, min_x, max_x, min_y, max_y);
+            frames.push_back(frame_to_image(buffers[0], trajectory.time(frame), min_x, max_x, min_y, max_y));
+        }
+    } else {
+        std::vector<std::vector<Vector2D>> positions(pool.size()), velocities(pool.size()), forces(pool.size());
+        for (size_t base = 0; base < num_frames; base += batch_size) {
+            int count = std::min(batch_size, num_frames - base);
+            pool.parallel_for(0, count, [&](int start, int end, int thread_id) {
+                for (int k = start; k < end; ++k) {
+                    trajectory.readFrame(base + k, positions[thread_id], velocities[thread_id], forces[thread_id]);
+                    save_frame(positions[thread_id], velocities[thread_id], forces[thread_id], n, buffers[k], min_x, max_x, min_y, max_y);
+                }
+            });
+            for (int k = 0; k < count; ++k) {
+                frames.push_back(frame_to_image(buffers[k], trajectory.time(base + k), min_x, max_x, min_y, max_y));
+            }
+        }
     }
 
     Magick::writeImages(frames.begin(), frames.end(), "nbody_simulation.gif");
 }
 
-int main() {
+// Left out when the engine is linked into another program, such as the
+// benchmarks
+#ifndef NBODY_NO_MAIN
+int main(int argc, char **argv) {
     int n;
     std::vector<double> masses;
     std::vector<Vector2D> positions, velocities;
     double time_step, total_time;
 
-    gather_input(n, masses, positions, velocities, time_step, total_time);
+    ThreadPool pool;
+    if (argc > 1) {
+        // Bodies from a file or a generator instead of typing them in
+        BodyTable table;
+        if (!load_bodies(argc - 1, argv + 1, table, pool)) return 1;
+        unpack_bodies(table, masses, positions, velocities);
+        n = masses.size();
+        gather_run_settings(time_step, total_time);
+    } else {
+        gather_input(n, masses, positions, velocities, time_step, total_time);
+    }
 
     std::vector<Vector2D> forces(n);
-    
-    std::vector<std::vector<Vector2D>> all_positions, all_velocities, all_forces;
-    all_positions.push_back(positions);
-    all_velocities.push_back(velocities);
+    const int output_every = 1; // Record and print every k-th step
+    const bool count_events = false; // Print hardware counters per phase after the run
+    if (count_events && !profile_start()) return 1;
+    // leapfrog and hermite4 cost one force evaluation per step like euler but
+    // hold the energy error at steps 10-100x longer; yoshida4 costs three
+    DirectSumIntegrator integrator(Integrator::leapfrog, pool);
+    std::cout << "Force kernel: " << simd_level_name(detect_simd_level()) << ", integrator: "
+              << integrator_name(integrator.method()) << std::endl;
+
+    TrajectoryWriter trajectory("nbody_simulation.traj", n);
+    trajectory.append(0.0, positions, velocities, forces);
+
+    // Recording and printing happen on the pipeline's thread
+    OutputPipeline<Vector2D> output([&trajectory](const Snapshot<Vector2D> &state) {
+        ProfileScope profile(ProfilePhase::output);
+        trajectory.append(state.time, state.r, state.v, state.f);
+        std::cout << "Time: " << state.time << "\n";
+        for (size_t i = 0; i < state.r.size(); ++i) {
+            std::cout << "Body " << i + 1 << ": Position (" << state.r[i].x << ", " << state.r[i].y << ")\n";
+        }
+    }, output_every);
 
+    size_t step = 0;
     for (double t = 0; t < total_time; t += time_step) {
-        compute_forces(n, masses, positions, forces);
-        update_bodies(n, masses, positions, velocities, forces, time_step);
+        integrator.step(masses, positions, velocities, forces, time_step);
 
-        all_positions.push_back(positions);
-        all_velocities.push_back(velocities);
-        all_forces.push_back(forces);
-                std::cout << "Time: " << t + time_step << std::endl;
-        for (int i = 0; i < n; ++i) {
-            std::cout << "Body " << i + 1 << ": Position (" << positions[i].x << ", " << positions[i].y << ")" << std::endl;
-        }
-    }    
+        ProfileScope profile(ProfilePhase::output);
+        output.publish(++step, t + time_step, positions, velocities, forces);
+    }
+
+    output.finish();
+    std::cout << std::flush;
+    if (count_events) {
+        profile_stop().print(std::cout, double(n - 1) * integrator.bodyForceEvaluations());
+    }
+    trajectory.close();
 
-    visualize(all_positions, all_velocities, all_forces, n, time_step, total_time);
+    TrajectoryReader reader;
+    if (!reader.open("nbody_simulation.traj")) return 1;
+    visualize(reader, pool);
 
     return 0;
 }
+#endif // NBODY_NO_MAIN
@@ -3,15 +3,25 @@
 
 #include <vector>
 #include <Magick++.h>
+#include "thread_pool.hpp"
+#include "direct_sum.hpp"
+#include "trajectory.hpp"
+#include "initial_conditions.hpp"
+#include "rasterizer.hpp"
+#include "output_pipeline.hpp"
+#include "perf_counters.hpp"
 
 struct Vector2D {
     double x, y;
 };
 
 void gather_input(int &n, std::vector<double> &masses, std::vector<Vector2D> &positions, std::vector<Vector2D> &velocities, double &time_step, double &total_time);
-void compute_forces(const int n, const std::vector<double>& masses, const std::vector<Vector2D>& positions, std::vector<Vector2D>& forces, const double G = 6.67430e-11);
-void update_bodies(int n, std::vector<double>& masses, std::vector<Vector2D>& positions, std::vector<Vector2D>& velocities, std::vector<Vector2D>& forces, double time_step);
-void draw_arrow(Magick::Image &frame, int x1, int y1, double dx, double dy, const std::string &color);
-void save_frame(const std::vector<Vector2D>& positions, const std::vector<Vector2D>& velocities, const std::vector<Vector2D>& forces, int n, int t, std::vector<Magick::Image>& frames, double min_x, double max_x, double min_y, double max_y);
-void visualize(const std::vector<std::vector<Vector2D>>& all_positions, const std::vector<std::vector<Vector2D>>& all_velocities, const std::vector<std::vector<Vector2D>>& all_forces, int n, double time_step, double total_time);
+void gather_run_settings(double &time_step, double &total_time);
+void compute_forces(const int n, const std::vector<double>& masses, const std::vector<Vector2D>& positions, std::vector<Vector2D>& forces, ThreadPool& pool, const double G = 6.67430e-11);
+void compute_forces_simd(const int n, const std::vector<double>& masses, const std::vector<Vector2D>& positions, std::vector<Vector2D>& forces, BodiesSoA& soa, ThreadPool& pool, const double G = 6.67430e-11);
+void update_bodies(int n, std::vector<double>& masses, std::vector<Vector2D>& positions, std::vector<Vector2D>& velocities, std::vector<Vector2D>& forces, double time_step, ThreadPool& pool);
+void draw_arrow(Framebuffer &frame, int x1, int y1, double dx, double dy, Rgba color);
+void save_frame(const std::vector<Vector2D>& positions, const std::vector<Vector2D>& velocities, const std::vector<Vector2D>& forces, int n, Framebuffer &frame, double min_x, double max_x, double min_y, double max_y);
+Magick::Image frame_to_image(const Framebuffer &buffer, int t, double min_x, double max_x, double min_y, double max_y);
+void visualize(const TrajectoryReader &trajectory, ThreadPool &pool);
 #endif // NBODY_SIMULATION_HPP
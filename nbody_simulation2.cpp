@@ -4,6 +4,7 @@
 #include <vector>
 #include <Magick++.h>
 #include <cmath>
+#include <algorithm>
 
 using namespace Magick;
 
@@ -34,13 +35,17 @@ void gather_input(int &n, std::vector<double> &masses, std::vector<Vector2D> &po
         std::cin >> velocities[i].y;
     }
 
+    gather_run_settings(time_step, total_time);
+}
+
+void gather_run_settings(double &time_step, double &total_time) {
     std::cout << "Enter the time step for the simulation (seconds): ";
     std::cin >> time_step;
     std::cout << "Enter the total simulation time (seconds): ";
     std::cin >> total_time;
 }
 
-void draw_arrow(Magick::Image &frame, int x1, int y1, double dx, double dy, const std::string &color) {
+void draw_arrow(Framebuffer &frame, int x1, int y1, double dx, double dy, Rgba color) {
     double angle = std::atan2(dy, dx);
     const double arrow_length = 15;
     const double arrow_angle = M_PI / 6; // 30 degrees for each arrowhead wing
@@ -53,19 +58,16 @@ void draw_arrow(Magick::Image &frame, int x1, int y1, double dx, double dy, cons
     int x4 = x2 - static_cast<int>(arrow_length / 3 * std::cos(angle + arrow_angle));
     int y4 = y2 - static_cast<int>(arrow_length / 3 * std::sin(angle + arrow_angle));
 
-    frame.strokeColor(color);
-
-    frame.draw(Magick::DrawableLine(x1, y1, x2, y2));
-    frame.draw(Magick::DrawableLine(x2, y2, x3, y3));
-    frame.draw(Magick::DrawableLine(x2, y2, x4, y4));
+    frame.drawLine(x1, y1, x2, y2, color, 2);
+    frame.drawLine(x2, y2, x3, y3, color, 2);
+    frame.drawLine(x2, y2, x4, y4, color, 2);
 }
 
-void save_frame(const std::vector<Vector2D> &positions, const std::vector<Vector2D> &velocities, const std::vector<Vector2D> &forces, int n, int t, std::vector<Magick::Image> &frames, double min_x, double max_x, double min_y, double max_y) {
-    int width = 800;
-    int height = 800;
-    Magick::Image frame(Magick::Geometry(width, height), "white");
-    frame.strokeWidth(2);
-    std::vector<std::string> colors = {"red", "green", "blue", "yellow", "cyan", "magenta", "orange", "purple", "brown", "pink"};
+void save_frame(const std::vector<Vector2D> &positions, const std::vector<Vector2D> &velocities, const std::vector<Vector2D> &forces, int n, Framebuffer &frame, double min_x, double max_x, double min_y, double max_y) {
+    int width = frame.width();
+    int height = frame.height();
+    frame.clear(colors::white);
+    const std::vector<Rgba> palette = {colors::red, colors::green, colors::blue, colors::yellow, colors::cyan, colors::magenta, colors::orange, colors::purple, colors::brown, colors::pink};
 
     double range_x = max_x - min_x;
     double range_y = max_y - min_y;
@@ -74,44 +76,52 @@ void save_frame(const std::vector<Vector2D> &positions, const std::vector<Vector
         int x = ((positions[i].x - min_x) / range_x) * width;
         int y = height - ((positions[i].y - min_y) / range_y) * height;
 
-        frame.fillColor(colors[i % colors.size()]);
-        frame.strokeColor("black");
-        frame.draw(Magick::DrawableCircle(x, y, x + 3, y + 3));
+        // Filled disc of radius ~4 with a 2 pixel black outline
+        frame.fillCircle(x, y, 5, colors::black);
+        frame.fillCircle(x, y, 3, palette[i % palette.size()]);
 
         double vx = (velocities[i].x / range_x) * width;
         double vy = -(velocities[i].y / range_y) * height; // Negative because the y-axis is inverted in the image
         double Fx = (forces[i].x / range_x) * width;
         double Fy = -(forces[i].y / range_y) * height; // Negative because the y-axis is inverted in the image
 
-        frame.fillColor("none"); // Reset fill color before drawing arrows
-        draw_arrow(frame, x, y, vx, vy, colors[i % colors.size()]); // velocities are in the color of the object
+        draw_arrow(frame, x, y, vx, vy, palette[i % palette.size()]); // velocities are in the color of the object
         if (n > 1) {
-            for (const auto &force : forces) {
-                draw_arrow(frame, x, y, Fx, Fy, "black"); // forces are in color black
-            }
+            draw_arrow(frame, x, y, Fx, Fy, colors::black); // forces are in color black
         }
     }
+}
+
+Magick::Image frame_to_image(const Framebuffer &buffer, int t, double min_x, double max_x, double min_y, double max_y) {
+    Magick::Image frame(buffer.width(), buffer.height(), "RGBA", Magick::CharPixel, buffer.data());
     frame.strokeColor("black");
     std::string border_info = "Time: " + std::to_string(t) +
                               "\nRange: [" + std::to_string(min_x) + ", " + std::to_string(max_x) + "] x " +
                               "[" + std::to_string(min_y) + ", " + std::to_string(max_y) + "]";
     frame.annotate(border_info, Magick::NorthWestGravity);
-    frames.push_back(frame);
+    return frame;
 }
 
-void visualize(const std::vector<std::vector<Vector2D>> &all_positions, const std::vector<std::vector<Vector2D>> &all_velocities, const std::vector<std::vector<Vector2D>> &all_forces, int n, double time_step, double total_time) {
+void visualize(const TrajectoryReader &trajectory, ThreadPool &pool) {
     Magick::InitializeMagick(nullptr);
     std::vector<Magick::Image> frames;
-    double min_x = all_positions[0][0].x;
-    double max_x = all_positions[0][0].x;
-    double min_y = all_positions[0][0].y;
-    double max_y = all_positions[0][0].y;
-    for (const auto &positions_at_time : all_positions) {
-        for (const auto &pos : positions_at_time) {
-            if (pos.x < min_x) min_x = pos.x;
-            if (pos.x > max_x) max_x = pos.x;
-            if (pos.y < min_y) min_y = pos.y;
-            if (pos.y > max_y) max_y = pos.y;
+    if (trajectory.numFrames() == 0 || trajectory.numBodies() == 0) {
+        std::cerr << "Error: No positions available for visualization\n";
+        return;
+    }
+    int n = trajectory.numBodies();
+    double min_x = trajectory.component(0, 0)[0];
+    double max_x = min_x;
+    double min_y = trajectory.component(0, 1)[0];
+    double max_y = min_y;
+    for (size_t frame = 0; frame < trajectory.numFrames(); ++frame) {
+        const double *x = trajectory.component(frame, 0);
+        const double *y = trajectory.component(frame, 1);
+        for (int i = 0; i < n; ++i) {
+            if (x[i] < min_x) min_x = x[i];
+            if (x[i] > max_x) max_x = x[i];
+            if (y[i] < min_y) min_y = y[i];
+            if (y[i] > max_y) max_y = y[i];
         }
     }
 
@@ -122,20 +132,54 @@ void visualize(const std::vector<std::vector<Vector2D>> &all_positions, const st
     min_y -= margin_y;
     max_y += margin_y;
 
-    for (double t = 0; t < total_time; t += time_step) {
-        save_frame(all_positions[t], all_velocities[t], all_forces[t], n, t * time_step, frames, min_x, max_x, min_y, max_y);
+    // Frames are rasterized in batches, several at once on the pool, and then
+    // handed to Magick in order
+    size_t num_frames = trajectory.numFrames();
+    size_t batch_size = 2 * pool.size();
+    std::vector<Framebuffer> buffers(batch_size);
+    if (trajectory.numBodies() > density_threshold) {
+        // One frame at a time, each binned by the whole pool
+        DensityRenderer density(pool);
+        for (size_t frame = 0; frame < num_frames; ++frame) {
+            density.render(buffers[0], trajectory.component(frame, 0), trajectory.component(frame, 1), nullptr, n, min_x, max_x, min_y, max_y);
+            frames.push_back(frame_to_image(buffers[0], trajectory.time(frame), min_x, max_x, min_y, max_y));
+        }
+    } else {
+        std::vector<std::vector<Vector2D>> positions(pool.size()), velocities(pool.size()), forces(pool.size());
+        for (size_t base = 0; base < num_frames; base += batch_size) {
+            int count = std::min(batch_size, num_frames - base);
+            pool.parallel_for(0, count, [&](int start, int end, int thread_id) {
+                for (int k = start; k < end; ++k) {
+                    trajectory.readFrame(base + k, positions[thread_id], velocities[thread_id], forces[thread_id]);
+                    save_frame(positions[thread_id], velocities[thread_id], forces[thread_id], n, buffers[k], min_x, max_x, min_y, max_y);
+                }
+            });
+            for (int k = 0; k < count; ++k) {
+                frames.push_back(frame_to_image(buffers[k], trajectory.time(base + k), min_x, max_x, min_y, max_y));
+            }
+        }
     }
 
     Magick::writeImages(frames.begin(), frames.end(), "nbody_simulation.gif");
 }
 
-int main() {
+int main(int argc, char **argv) {
     int n;
     std::vector<double> masses;
     std::vector<Vector2D> positions, velocities;
     double time_step, total_time;
 
-    gather_input(n, masses, positions, velocities, time_step, total_time);
+    ThreadPool pool; // Only used to load bodies and render frames
+    if (argc > 1) {
+        // Bodies from a file or a generator instead of typing them in
+        BodyTable table;
+        if (!load_bodies(argc - 1, argv + 1, table, pool)) return 1;
+        unpack_bodies(table, masses, positions, velocities);
+        n = masses.size();
+        gather_run_settings(time_step, total_time);
+    } else {
+        gather_input(n, masses, positions, velocities, time_step, total_time);
+    }
 
     Scenario bodies;
     bodies.m = masses;
@@ -144,14 +188,26 @@ int main() {
 
     std::vector<Vector2D> forces(n);
 
-    std::vector<std::vector<Vector2D>> all_positions, all_velocities, all_forces;
-    all_positions.push_back(bodies.r);
-    all_velocities.push_back(bodies.v);
-    all_forces.push_back(forces);
-
-    barnes_hut(bodies, time_step, total_time, all_positions, all_velocities, all_forces);
-
-    visualize(all_positions, all_velocities, all_forces, n, time_step, total_time);
+    TrajectoryWriter trajectory("nbody_simulation2.traj", n);
+    trajectory.append(0.0, bodies.r, bodies.v, forces);
+
+    BarnesHutWorkspace workspace;
+    workspace.opening_angle = theta;
+    // Quadrupole corrections reach the same force error at a larger opening
+    // angle, so each body visits fewer cells
+    workspace.use_quadrupole = false;
+    // Set to keep the tree between steps, rebuilding only the parts bodies
+    // left; test_barnes_hut times both on a large cluster
+    workspace.refit = false;
+    // Set to e.g. 1e-3 to pick the opening angle from the force error instead
+    // of using theta
+    const double force_error_budget = 0;
+    barnes_hut(bodies, time_step, total_time, trajectory, workspace, TreeWalk::pointer, 1, force_error_budget);
+    trajectory.close();
+
+    TrajectoryReader reader;
+    if (!reader.open("nbody_simulation2.traj")) return 1;
+    visualize(reader, pool);
 
     return 0;
 }
@@ -1,9 +1,12 @@
 #include "nbody_simulation_bhmulti.hpp"
 #include "barnes_hut_multi.hpp"
+#include "perf_counters.hpp"
+#include "trace.hpp"
 #include <iostream>
 #include <vector>
 #include <Magick++.h>
 #include <cmath>
+#include <algorithm>
 #include <mutex>
 
 using namespace Magick;
@@ -36,6 +39,10 @@ void gather_input(int &n, std::vector<double> &masses, std::vector<Vector2D> &po
         std::cin >> velocities[i].y;
     }
 
+    gather_run_settings(time_step, total_time, num_threads);
+}
+
+void gather_run_settings(double &time_step, double &total_time, int &num_threads) {
     std::cout << "Enter the time step for the simulation (seconds): ";
     std::cin >> time_step;
     std::cout << "Enter the total simulation time (seconds): ";
@@ -44,7 +51,7 @@ void gather_input(int &n, std::vector<double> &masses, std::vector<Vector2D> &po
     std::cin >> num_threads;
 }
 
-void draw_arrow(Magick::Image &frame, int x1, int y1, double dx, double dy, const std::string &color) {
+void draw_arrow(Framebuffer &frame, int x1, int y1, double dx, double dy, Rgba color) {
     double angle = std::atan2(dy, dx);
     const double arrow_length = 15;
     const double arrow_angle = M_PI / 6; // 30 degrees for each arrowhead wing
@@ -57,19 +64,16 @@ void draw_arrow(Magick::Image &frame, int x1, int y1, double dx, double dy, cons
     int x4 = x2 - static_cast<int>(arrow_length / 3 * std::cos(angle + arrow_angle));
     int y4 = y2 - static_cast<int>(arrow_length / 3 * std::sin(angle + arrow_angle));
 
-    frame.strokeColor(color);
-
-    frame.draw(Magick::DrawableLine(x1, y1, x2, y2));
-    frame.draw(Magick::DrawableLine(x2, y2, x3, y3));
-    frame.draw(Magick::DrawableLine(x2, y2, x4, y4));
+    frame.drawLine(x1, y1, x2, y2, color, 2);
+    frame.drawLine(x2, y2, x3, y3, color, 2);
+    frame.drawLine(x2, y2, x4, y4, color, 2);
 }
 
-void save_frame(const std::vector<Vector2D> &positions, const std::vector<Vector2D> &velocities, const std::vector<Vector2D> &forces, int n, int t, std::vector<Magick::Image> &frames, double min_x, double max_x, double min_y, double max_y) {
-    int width = 800;
-    int height = 800;
-    Magick::Image frame(Magick::Geometry(width, height), "white");
-    frame.strokeWidth(2);
-    std::vector<std::string> colors = {"red", "green", "blue", "yellow", "cyan", "magenta", "orange", "purple", "brown", "pink"};
+void save_frame(const std::vector<Vector2D> &positions, const std::vector<Vector2D> &velocities, const std::vector<Vector2D> &forces, int n, Framebuffer &frame, double min_x, double max_x, double min_y, double max_y) {
+    int width = frame.width();
+    int height = frame.height();
+    frame.clear(colors::white);
+    const std::vector<Rgba> palette = {colors::red, colors::green, colors::blue, colors::yellow, colors::cyan, colors::magenta, colors::orange, colors::purple, colors::brown, colors::pink};
 
     double range_x = max_x - min_x;
     double range_y = max_y - min_y;
@@ -83,53 +87,58 @@ void save_frame(const std::vector<Vector2D> &positions, const std::vector<Vector
         int x = ((positions[i].x - min_x) / range_x) * width;
         int y = height - ((positions[i].y - min_y) / range_y) * height;
 
-        frame.fillColor(colors[i % colors.size()]);
-        frame.strokeColor("black");
-        frame.draw(Magick::DrawableCircle(x, y, x + 3, y + 3));
+        // Filled disc of radius ~4 with a 2 pixel black outline
+        frame.fillCircle(x, y, 5, colors::black);
+        frame.fillCircle(x, y, 3, palette[i % palette.size()]);
 
         double vx = (velocities[i].x / range_x) * width;
         double vy = -(velocities[i].y / range_y) * height; // Negative because the y-axis is inverted in the image
         double Fx = (forces[i].x / range_x) * width;
         double Fy = -(forces[i].y / range_y) * height; // Negative because the y-axis is inverted in the image
 
-        frame.fillColor("none"); // Reset fill color before drawing arrows
-        draw_arrow(frame, x, y, vx, vy, colors[i % colors.size()]); // velocities are in the color of the object
+        draw_arrow(frame, x, y, vx, vy, palette[i % palette.size()]); // velocities are in the color of the object
         if (n > 1) {
-            draw_arrow(frame, x, y, Fx, Fy, "black"); // forces are in color black
+            draw_arrow(frame, x, y, Fx, Fy, colors::black); // forces are in color black
         }
     }
+}
 
+Magick::Image frame_to_image(const Framebuffer &buffer, int t, double min_x, double max_x, double min_y, double max_y) {
+    Magick::Image frame(buffer.width(), buffer.height(), "RGBA", Magick::CharPixel, buffer.data());
     frame.strokeColor("black");
     std::string border_info = "Time: " + std::to_string(t) +
                               "\nRange: [" + std::to_string(min_x) + ", " + std::to_string(max_x) + "] x " +
                               "[" + std::to_string(min_y) + ", " + std::to_string(max_y) + "]";
     frame.annotate(border_info, Magick::NorthWestGravity);
-    frames.push_back(frame);
+    return frame;
 }
 
 
-void visualize(const std::vector<std::vector<Vector2D>> &all_positions, const std::vector<std::vector<Vector2D>> &all_velocities, const std::vector<std::vector<Vector2D>> &all_forces, int n, double time_step, double total_time) {
+void visualize(const TrajectoryReader &trajectory, ThreadPool &pool) {
     Magick::InitializeMagick(nullptr);
     std::vector<Magick::Image> frames;
 
     std::cout << "Initializing visualization...\n";
 
-    if (all_positions.empty() || all_positions[0].empty()) {
+    if (trajectory.numFrames() == 0 || trajectory.numBodies() == 0) {
         std::cerr << "Error: No positions available for visualization\n";
         return;
     }
 
-    double min_x = all_positions[0][0].x;
-    double max_x = all_positions[0][0].x;
-    double min_y = all_positions[0][0].y;
-    double max_y = all_positions[0][0].y;
-
-    for (const auto &positions_at_time : all_positions) {
-        for (const auto &pos : positions_at_time) {
-            if (pos.x < min_x) min_x = pos.x;
-            if (pos.x > max_x) max_x = pos.x;
-            if (pos.y < min_y) min_y = pos.y;
-            if (pos.y > max_y) max_y = pos.y;
+    int n = trajectory.numBodies();
+    double min_x = trajectory.component(0, 0)[0];
+    double max_x = min_x;
+    double min_y = trajectory.component(0, 1)[0];
+    double max_y = min_y;
+
+    for (size_t frame = 0; frame < trajectory.numFrames(); ++frame) {
+        const double *x = trajectory.component(frame, 0);
+        const double *y = trajectory.component(frame, 1);
+        for (int i = 0; i < n; ++i) {
+            if (x[i] < min_x) min_x = x[i];
+            if (x[i] > max_x) max_x = x[i];
+            if (y[i] < min_y) min_y = y[i];
+            if (y[i] > max_y) max_y = y[i];
         }
     }
 
@@ -142,20 +151,32 @@ void visualize(const std::vector<std::vector<Vector2D>> &all_positions, const st
 
     std::cout << "Generating frames...\n";
 
-    for (size_t t = 0; t < all_positions.size(); ++t) {
-        std::cout << "Saving frame " << t << "...\n";
-        if (t >= all_velocities.size() || t >= all_forces.size()) {
-            std::cerr << "Error: Out of bounds access in visualize\n";
-            return;
+    // Frames are rasterized in batches, several at once on the pool, and then
+    // handed to Magick in order
+    size_t num_frames = trajectory.numFrames();
+    size_t batch_size = 2 * pool.size();
+    std::vector<Framebuffer> buffers(batch_size);
+    if (trajectory.numBodies() > density_threshold) {
+        // One frame at a time, each binned by the whole pool
+        DensityRenderer density(pool);
+        for (size_t frame = 0; frame < num_frames; ++frame) {
+            density.render(buffers[0], trajectory.component(frame, 0), trajectory.component(frame, 1), nullptr, n, min_x, max_x, min_y, max_y);
+            frames.push_back(frame_to_image(buffers[0], trajectory.time(frame), min_x, max_x, min_y, max_y));
         }
-
-        // Ensure the sizes of the positions, velocities, and forces vectors match
-        if (all_positions[t].size() != all_velocities[t].size() || all_positions[t].size() != all_forces[t].size()) {
-            std::cerr << "Error: Mismatch in sizes of positions, velocities, and forces at time " << t << "\n";
-            return;
+    } else {
+        std::vector<std::vector<Vector2D>> positions(pool.size()), velocities(pool.size()), forces(pool.size());
+        for (size_t base = 0; base < num_frames; base += batch_size) {
+            int count = std::min(batch_size, num_frames - base);
+            pool.parallel_for(0, count, [&](int start, int end, int thread_id) {
+                for (int k = start; k < end; ++k) {
+                    trajectory.readFrame(base + k, positions[thread_id], velocities[thread_id], forces[thread_id]);
+                    save_frame(positions[thread_id], velocities[thread_id], forces[thread_id], n, buffers[k], min_x, max_x, min_y, max_y);
+                }
+            });
+            for (int k = 0; k < count; ++k) {
+                frames.push_back(frame_to_image(buffers[k], trajectory.time(base + k), min_x, max_x, min_y, max_y));
+            }
         }
-
-        save_frame(all_positions[t], all_velocities[t], all_forces[t], n, t * time_step, frames, min_x, max_x, min_y, max_y);
     }
 
     std::cout << "Writing images...\n";
@@ -165,14 +186,24 @@ void visualize(const std::vector<std::vector<Vector2D>> &all_positions, const st
 
 
 
-int main() {
+int main(int argc, char **argv) {
     int n;
     std::vector<double> masses;
     std::vector<Vector2D> positions, velocities;
     double time_step, total_time;
     int num_threads;
 
-    gather_input(n, masses, positions, velocities, time_step, total_time, num_threads);
+    if (argc > 1) {
+        // Bodies from a file or a generator instead of typing them in
+        gather_run_settings(time_step, total_time, num_threads);
+        ThreadPool pool(num_threads);
+        BodyTable table;
+        if (!load_bodies(argc - 1, argv + 1, table, pool)) return 1;
+        unpack_bodies(table, masses, positions, velocities);
+        n = masses.size();
+    } else {
+        gather_input(n, masses, positions, velocities, time_step, total_time, num_threads);
+    }
 
     Scenario bodies;
     bodies.m = masses;
@@ -182,17 +213,28 @@ int main() {
 
     std::vector<Vector2D> forces(n, Vector2D{0, 0});
 
-    std::vector<std::vector<Vector2D>> all_positions, all_velocities, all_forces;
-    all_positions.push_back(bodies.r);
-    all_velocities.push_back(bodies.v);
-    all_forces.push_back(bodies.f);
+    TrajectoryWriter trajectory("nbody_simulation3.traj", n);
+    trajectory.append(0.0, bodies.r, bodies.v, bodies.f);
+
+    // Set to e.g. "nbody_simulation3.trace.json" to record a timeline of the
+    // run for chrome://tracing or ui.perfetto.dev
+    const std::string trace_file = "";
+    if (!trace_file.empty() && !trace_start(trace_file)) return 1;
+    const bool count_events = false; // Print hardware counters per phase after the run
+    if (count_events && !profile_start()) return 1;
 
     std::cout << "Starting simulation...\n";
-    barnes_hut(bodies, time_step, total_time, all_positions, all_velocities, all_forces, num_threads);
+    barnes_hut(bodies, time_step, total_time, trajectory, num_threads);
+    if (!trace_file.empty()) trace_stop();
+    if (count_events) profile_stop().print(std::cout);
+    trajectory.close();
     std::cout << "Simulation complete.\n";
 
     std::cout << "Starting visualization...\n";
-    visualize(all_positions, all_velocities, all_forces, n, time_step, total_time);
+    TrajectoryReader reader;
+    if (!reader.open("nbody_simulation3.traj")) return 1;
+    ThreadPool pool(num_threads);
+    visualize(reader, pool);
     std::cout << "Visualization complete.\n";
 
     return 0;
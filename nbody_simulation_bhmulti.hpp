@@ -5,6 +5,10 @@
 #include <vector>
 #include <Magick++.h>
 #include <cmath>
+#include "thread_pool.hpp"
+#include "trajectory.hpp"
+#include "initial_conditions.hpp"
+#include "rasterizer.hpp"
 
 struct Vector2D {
     double x, y;
@@ -66,8 +70,10 @@ struct Scenario {
 };
 
 void gather_input(int &n, std::vector<double> &masses, std::vector<Vector2D> &positions, std::vector<Vector2D> &velocities, double &time_step, double &total_time, int &num_threads);
-void draw_arrow(Magick::Image &frame, int x1, int y1, double dx, double dy, const std::string &color);
-void save_frame(const std::vector<Vector2D> &positions, const std::vector<Vector2D> &velocities, const std::vector<Vector2D> &forces, int n, int t, std::vector<Magick::Image> &frames, double min_x, double max_x, double min_y, double max_y);
-void visualize(const std::vector<std::vector<Vector2D>> &all_positions, const std::vector<std::vector<Vector2D>> &all_velocities, const std::vector<std::vector<Vector2D>> &all_forces, int n, double time_step, double total_time);
+void gather_run_settings(double &time_step, double &total_time, int &num_threads);
+void draw_arrow(Framebuffer &frame, int x1, int y1, double dx, double dy, Rgba color);
+void save_frame(const std::vector<Vector2D> &positions, const std::vector<Vector2D> &velocities, const std::vector<Vector2D> &forces, int n, Framebuffer &frame, double min_x, double max_x, double min_y, double max_y);
+Magick::Image frame_to_image(const Framebuffer &buffer, int t, double min_x, double max_x, double min_y, double max_y);
+void visualize(const TrajectoryReader &trajectory, ThreadPool &pool);
 
 #endif // NBODY_SIMULATION_BHMULTI_HPP
@@ -0,0 +1,116 @@
+#ifndef OUTPUT_PIPELINE_HPP
+#define OUTPUT_PIPELINE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Copy of the state of the system after one time step.
+template <typename Vec>
+struct Snapshot {
+    size_t step;
+    double time;
+    std::vector<Vec> r, v, f;
+};
+
+// Moves output (trajectory recording, printing, frame generation) off the
+// simulation thread. publish() copies the state into one of a fixed set of
+// snapshot buffers and returns; a background thread hands each filled buffer
+// to the consumer and then recycles it. With two buffers the solver writes one
+// while the consumer reads the other, and only waits if the consumer falls a
+// whole buffer behind.
+template <typename Vec>
+class OutputPipeline {
+public:
+    typedef std::function<void(const Snapshot<Vec> &)> Consumer;
+
+    // Only every output_every-th published step reaches the consumer.
+    explicit OutputPipeline(const Consumer &consumer, int output_every = 1, size_t num_buffers = 2)
+        : consumer(consumer),
+          output_every(output_every > 0 ? output_every : 1),
+          buffers(num_buffers > 0 ? num_buffers : 1) {
+        for (auto &buffer : buffers) free_buffers.push_back(&buffer);
+        worker = std::thread(&OutputPipeline::consume, this);
+    }
+
+    ~OutputPipeline() {
+        finish();
+    }
+
+    OutputPipeline(const OutputPipeline &) = delete;
+    OutputPipeline &operator=(const OutputPipeline &) = delete;
+
+    void publish(size_t step, double time, const std::vector<Vec> &r, const std::vector<Vec> &v, const std::vector<Vec> &f) {
+        if (step % output_every != 0) return;
+
+        Snapshot<Vec> *buffer;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            buffer_free.wait(lock, [this] { return !free_buffers.empty(); });
+            buffer = free_buffers.front();
+            free_buffers.pop_front();
+        }
+
+        // Copy outside the lock so the consumer keeps going meanwhile
+        buffer->step = step;
+        buffer->time = time;
+        buffer->r.assign(r.begin(), r.end());
+        buffer->v.assign(v.begin(), v.end());
+        buffer->f.assign(f.begin(), f.end());
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(buffer);
+        }
+        buffer_ready.notify_one();
+    }
+
+    // Waits for every published snapshot to be consumed and stops the thread.
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (done) return;
+            done = true;
+        }
+        buffer_ready.notify_one();
+        worker.join();
+    }
+
+private:
+    void consume() {
+        while (true) {
+            Snapshot<Vec> *buffer;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                buffer_ready.wait(lock, [this] { return done || !ready.empty(); });
+                if (ready.empty()) return;
+                buffer = ready.front();
+                ready.pop_front();
+            }
+
+            consumer(*buffer);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                free_buffers.push_back(buffer);
+            }
+            buffer_free.notify_one();
+        }
+    }
+
+    Consumer consumer;
+    size_t output_every;
+    std::vector<Snapshot<Vec>> buffers;
+    std::deque<Snapshot<Vec> *> free_buffers;
+    std::deque<Snapshot<Vec> *> ready;
+    std::mutex mutex;
+    std::condition_variable buffer_free;
+    std::condition_variable buffer_ready;
+    bool done = false;
+    std::thread worker;
+};
+
+#endif // OUTPUT_PIPELINE_HPP
@@ -0,0 +1,187 @@
+#include "perf_counters.hpp"
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+std::atomic<bool> profile_active(false);
+
+std::string profile_phase_name(ProfilePhase phase) {
+    switch (phase) {
+        case ProfilePhase::build:
+            return "build";
+        case ProfilePhase::forces:
+            return "forces";
+        case ProfilePhase::integrate:
+            return "integrate";
+        default:
+            return "output";
+    }
+}
+
+void CounterValues::add(const CounterValues &other) {
+    cycles += other.cycles;
+    instructions += other.instructions;
+    cache_misses += other.cache_misses;
+    branch_misses += other.branch_misses;
+}
+
+static CounterValues difference(const CounterValues &end, const CounterValues &start) {
+    CounterValues d;
+    d.cycles = end.cycles - start.cycles;
+    d.instructions = end.instructions - start.instructions;
+    d.cache_misses = end.cache_misses - start.cache_misses;
+    d.branch_misses = end.branch_misses - start.branch_misses;
+    return d;
+}
+
+// The four events of one thread, opened as a group so one read() returns them
+// all, counted in user space only.
+struct ThreadCounters {
+    int fds[4] = {-1, -1, -1, -1};
+    bool opened = false;
+    int depth = 0; // Open scopes on the thread
+    std::vector<CounterValues> phases = std::vector<CounterValues>(num_profile_phases);
+
+    ~ThreadCounters() {
+#ifdef __linux__
+        for (int fd : fds) {
+            if (fd >= 0) close(fd);
+        }
+#endif
+    }
+
+    bool open();
+    CounterValues read() const;
+};
+
+#ifdef __linux__
+static int open_event(uint64_t config, int group_fd) {
+    perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+bool ThreadCounters::open() {
+    const uint64_t events[4] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (int k = 0; k < 4; ++k) {
+        fds[k] = open_event(events[k], k == 0 ? -1 : fds[0]);
+        if (fds[k] < 0) return false;
+    }
+    return true;
+}
+
+CounterValues ThreadCounters::read() const {
+    struct {
+        uint64_t count;
+        uint64_t values[4];
+    } group = {};
+    CounterValues values;
+    if (::read(fds[0], &group, sizeof(group)) != sizeof(group)) return values;
+    values.cycles = group.values[0];
+    values.instructions = group.values[1];
+    values.cache_misses = group.values[2];
+    values.branch_misses = group.values[3];
+    return values;
+}
+#else
+bool ThreadCounters::open() {
+    return false;
+}
+
+CounterValues ThreadCounters::read() const {
+    return CounterValues();
+}
+#endif
+
+static std::mutex registry_mutex;
+static std::vector<std::unique_ptr<ThreadCounters>> registry;
+// Bumped by every profile_start() so threads reopen their counters
+static unsigned long profile_generation = 0;
+
+static thread_local ThreadCounters *thread_counters = nullptr;
+static thread_local unsigned long thread_generation = 0;
+
+static ThreadCounters *current_counters() {
+    if (thread_counters == nullptr || thread_generation != profile_generation) {
+        // A thread whose counters fail to open just records nothing
+        std::unique_ptr<ThreadCounters> counters(new ThreadCounters());
+        counters->opened = counters->open();
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        thread_counters = counters.get();
+        thread_generation = profile_generation;
+        registry.push_back(std::move(counters));
+    }
+    return thread_counters;
+}
+
+bool profile_start() {
+    // The group is tried here first so that an unusable PMU is reported once
+    ThreadCounters probe;
+    if (!probe.open()) {
+        std::cerr << "Error: Hardware counters unavailable (perf_event_open failed; check /proc/sys/kernel/perf_event_paranoid)\n";
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.clear();
+    ++profile_generation;
+    profile_active.store(true);
+    return true;
+}
+
+ProfileReport profile_stop() {
+    ProfileReport report;
+    profile_active.store(false);
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (const auto &counters : registry) report.threads.push_back(counters->phases);
+    // Closes the counters; threads open new ones on the next profile_start()
+    registry.clear();
+    return report;
+}
+
+void ProfileScope::enter() {
+    counters = current_counters();
+    if (!counters->opened) {
+        counters = nullptr;
+        return;
+    }
+    outermost = counters->depth++ == 0;
+    if (outermost) start = counters->read();
+}
+
+void ProfileScope::leave() {
+    if (outermost) counters->phases[static_cast<int>(phase)].add(difference(counters->read(), start));
+    counters->depth--;
+}
+
+CounterValues ProfileReport::phase(ProfilePhase phase) const {
+    CounterValues total;
+    for (const auto &thread : threads) total.add(thread[static_cast<int>(phase)]);
+    return total;
+}
+
+void ProfileReport::print(std::ostream &out, double interactions) const {
+    for (int p = 0; p < num_profile_phases; ++p) {
+        CounterValues c = phase(static_cast<ProfilePhase>(p));
+        if (c.cycles == 0) continue;
+        out << profile_phase_name(static_cast<ProfilePhase>(p)) << ": " << c.cycles << " cycles, " << c.instructions
+            << " instructions (IPC " << c.ipc() << "), " << c.cache_misses << " cache misses, " << c.branch_misses
+            << " branch misses";
+        if (interactions > 0) {
+            out << ", " << c.cache_misses / interactions << " cache misses and " << c.branch_misses / interactions
+                << " branch misses per interaction";
+        }
+        out << "\n";
+    }
+}
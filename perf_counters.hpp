@@ -0,0 +1,84 @@
+#ifndef PERF_COUNTERS_HPP
+#define PERF_COUNTERS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Hardware event counting per simulation phase, through Linux perf_event_open.
+// Between profile_start() and profile_stop() every ProfileScope reads the
+// calling thread's counters when it opens and closes and adds the difference
+// to that thread's total for its phase. Only the outermost scope on a thread
+// counts, so a phase can wrap the pool jobs that also open scopes. Both calls
+// must be made while no profiled code is running.
+//
+// While profiling is off a scope costs one relaxed atomic load.
+
+enum class ProfilePhase { build, forces, integrate, output };
+const int num_profile_phases = 4;
+std::string profile_phase_name(ProfilePhase phase);
+
+struct CounterValues {
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t cache_misses = 0;
+    uint64_t branch_misses = 0;
+
+    void add(const CounterValues &other);
+    double ipc() const { return cycles > 0 ? double(instructions) / cycles : 0; }
+};
+
+struct ProfileReport {
+    // threads[t][phase], threads numbered in the order they first counted
+    std::vector<std::vector<CounterValues>> threads;
+
+    CounterValues phase(ProfilePhase phase) const;
+    // Per phase: counts, IPC, and misses per interaction if interactions > 0.
+    void print(std::ostream &out, double interactions = 0) const;
+};
+
+// Returns false, and leaves profiling off, if the counters cannot be opened
+// (not Linux, or perf_event_paranoid forbids it).
+bool profile_start();
+ProfileReport profile_stop();
+
+extern std::atomic<bool> profile_active;
+
+inline bool profile_enabled() {
+    return profile_active.load(std::memory_order_relaxed);
+}
+
+struct ThreadCounters;
+
+class ProfileScope {
+public:
+    explicit ProfileScope(ProfilePhase phase) : phase(phase) {
+        if (profile_enabled()) enter();
+    }
+
+    ~ProfileScope() {
+        end();
+    }
+
+    // Stops counting before the end of the enclosing block.
+    void end() {
+        if (counters) leave();
+        counters = nullptr;
+    }
+
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
+
+private:
+    void enter();
+    void leave();
+
+    ProfilePhase phase;
+    ThreadCounters *counters = nullptr;
+    bool outermost = false;
+    CounterValues start;
+};
+
+#endif // PERF_COUNTERS_HPP
@@ -0,0 +1,117 @@
+#include "rasterizer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+Framebuffer::Framebuffer(int width, int height) : w(width), h(height), pixels(width * height) {}
+
+void Framebuffer::clear(Rgba color) {
+    std::fill(pixels.begin(), pixels.end(), color);
+}
+
+void Framebuffer::fillCircle(int cx, int cy, int radius, Rgba color) {
+    int y_begin = std::max(cy - radius, 0);
+    int y_end = std::min(cy + radius, h - 1);
+    for (int y = y_begin; y <= y_end; ++y) {
+        int dy = y - cy;
+        // Half-width of the span at this row
+        int span = 0;
+        while ((span + 1) * (span + 1) + dy * dy <= radius * radius) span++;
+        int x_begin = std::max(cx - span, 0);
+        int x_end = std::min(cx + span, w - 1);
+        for (int x = x_begin; x <= x_end; ++x) pixels[y * w + x] = color;
+    }
+}
+
+void Framebuffer::drawLine(int x1, int y1, int x2, int y2, Rgba color, int thickness) {
+    int dx = std::abs(x2 - x1);
+    int dy = -std::abs(y2 - y1);
+    int step_x = x1 < x2 ? 1 : -1;
+    int step_y = y1 < y2 ? 1 : -1;
+    int error = dx + dy;
+    int offset = (thickness - 1) / 2;
+
+    while (true) {
+        for (int ty = 0; ty < thickness; ++ty) {
+            for (int tx = 0; tx < thickness; ++tx) setPixel(x1 + tx - offset, y1 + ty - offset, color);
+        }
+        if (x1 == x2 && y1 == y2) break;
+        int e2 = 2 * error;
+        if (e2 >= dy) {
+            error += dy;
+            x1 += step_x;
+        }
+        if (e2 <= dx) {
+            error += dx;
+            y1 += step_y;
+        }
+    }
+}
+
+// Black through purple, red and orange to pale yellow, for t in [0, 1]
+static Rgba heat_color(double t) {
+    static const double stops[5][3] = {{0, 0, 0}, {87, 16, 110}, {188, 55, 84}, {249, 142, 9}, {252, 255, 164}};
+    double scaled = std::min(std::max(t, 0.0), 1.0) * 4;
+    int i = std::min(static_cast<int>(scaled), 3);
+    double f = scaled - i;
+    Rgba color;
+    color.r = static_cast<uint8_t>(stops[i][0] + f * (stops[i + 1][0] - stops[i][0]));
+    color.g = static_cast<uint8_t>(stops[i][1] + f * (stops[i + 1][1] - stops[i][1]));
+    color.b = static_cast<uint8_t>(stops[i][2] + f * (stops[i + 1][2] - stops[i][2]));
+    color.a = 255;
+    return color;
+}
+
+void DensityRenderer::render(Framebuffer &frame, const double *x, const double *y, const double *weights, size_t n,
+                             double min_x, double max_x, double min_y, double max_y) {
+    int width = frame.width();
+    int height = frame.height();
+    size_t num_pixels = static_cast<size_t>(width) * height;
+    bins.resize(pool.size());
+    for (auto &histogram : bins) histogram.assign(num_pixels, 0.0);
+
+    double scale_x = width / (max_x - min_x);
+    double scale_y = height / (max_y - min_y);
+    std::vector<double> weight_sum(pool.size(), 0.0);
+    pool.parallel_for(0, n, [&](int start, int end, int thread_id) {
+        std::vector<double> &histogram = bins[thread_id];
+        for (int i = start; i < end; ++i) {
+            double weight = weights ? weights[i] : 1.0;
+            weight_sum[thread_id] += weight;
+            int px = static_cast<int>((x[i] - min_x) * scale_x);
+            int py = height - 1 - static_cast<int>((y[i] - min_y) * scale_y);
+            if (px < 0 || px >= width || py < 0 || py >= height) continue;
+            histogram[py * width + px] += weight;
+        }
+    });
+
+    // Sum the per-thread histograms into the first one, row by row
+    std::vector<double> row_max(pool.size(), 0.0);
+    pool.parallel_for(0, height, [&](int start, int end, int thread_id) {
+        std::vector<double> &total = bins[0];
+        for (size_t p = static_cast<size_t>(start) * width; p < static_cast<size_t>(end) * width; ++p) {
+            for (size_t t = 1; t < bins.size(); ++t) total[p] += bins[t][p];
+            row_max[thread_id] = std::max(row_max[thread_id], total[p]);
+        }
+    });
+    double max_value = *std::max_element(row_max.begin(), row_max.end());
+    if (n == 0 || max_value <= 0) {
+        frame.clear(heat_color(0));
+        return;
+    }
+
+    // Measure pixels in units of the average body, so that a lone body gets
+    // the same color whether the histogram counts bodies or sums masses
+    double unit = 0;
+    for (double sum : weight_sum) unit += sum;
+    unit /= n;
+    double inverse_log_max = 1 / std::log1p(max_value / unit);
+    pool.parallel_for(0, height, [&](int start, int end, int) {
+        const std::vector<double> &total = bins[0];
+        for (int py = start; py < end; ++py) {
+            for (int px = 0; px < width; ++px) {
+                frame.setPixel(px, py, heat_color(std::log1p(total[py * width + px] / unit) * inverse_log_max));
+            }
+        }
+    });
+}
@@ -0,0 +1,76 @@
+#ifndef RASTERIZER_HPP
+#define RASTERIZER_HPP
+
+#include "thread_pool.hpp"
+#include <cstdint>
+#include <vector>
+
+struct Rgba {
+    uint8_t r, g, b, a;
+};
+
+// Colors used by save_frame, matching the ImageMagick names they replace
+namespace colors {
+const Rgba white = {255, 255, 255, 255};
+const Rgba black = {0, 0, 0, 255};
+const Rgba red = {255, 0, 0, 255};
+const Rgba green = {0, 128, 0, 255};
+const Rgba blue = {0, 0, 255, 255};
+const Rgba yellow = {255, 255, 0, 255};
+const Rgba cyan = {0, 255, 255, 255};
+const Rgba magenta = {255, 0, 255, 255};
+const Rgba orange = {255, 165, 0, 255};
+const Rgba purple = {128, 0, 128, 255};
+const Rgba brown = {165, 42, 42, 255};
+const Rgba pink = {255, 192, 203, 255};
+}
+
+// Raw RGBA image that frames are drawn into without going through
+// ImageMagick's vector pipeline. data() can be handed to Magick::Image with
+// the "RGBA" map and CharPixel storage.
+class Framebuffer {
+public:
+    explicit Framebuffer(int width = 800, int height = 800);
+
+    int width() const { return w; }
+    int height() const { return h; }
+    const uint8_t *data() const { return reinterpret_cast<const uint8_t *>(pixels.data()); }
+
+    void clear(Rgba color);
+
+    // Pixels outside the image are ignored
+    void setPixel(int x, int y, Rgba color) {
+        if (x >= 0 && x < w && y >= 0 && y < h) pixels[y * w + x] = color;
+    }
+
+    void fillCircle(int cx, int cy, int radius, Rgba color);
+    // Bresenham line, thickness pixels wide
+    void drawLine(int x1, int y1, int x2, int y2, Rgba color, int thickness = 1);
+
+private:
+    int w, h;
+    std::vector<Rgba> pixels;
+};
+
+// Above this many bodies visualize() draws a density heatmap instead of one
+// glyph per body
+const size_t density_threshold = 5000;
+
+// Draws a frame as a heatmap of how many bodies (or how much mass, if weights
+// is given) fall in each pixel, through a log colormap. Each thread bins its
+// share of the bodies into its own histogram, so there are no atomics; the
+// histograms are then summed pixel row by pixel row. The whole frame is one
+// O(N) pass plus O(pixels) for the reduction.
+class DensityRenderer {
+public:
+    explicit DensityRenderer(ThreadPool &pool) : pool(pool) {}
+
+    void render(Framebuffer &frame, const double *x, const double *y, const double *weights, size_t n,
+                double min_x, double max_x, double min_y, double max_y);
+
+private:
+    ThreadPool &pool;
+    std::vector<std::vector<double>> bins; // One histogram per thread, reused across frames
+};
+
+#endif // RASTERIZER_HPP
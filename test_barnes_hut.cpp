@@ -0,0 +1,310 @@
+#include "barnes_hut.hpp"
+#include "accuracy.hpp"
+#include "fmm.hpp"
+#include "linear_quadtree.hpp"
+#include "initial_conditions.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <vector>
+
+// Tests of the sequential Barnes-Hut engine. Each engine has its own
+// Vector2D, so the direct-sum engine has its own program, test_direct_sum.
+
+// Every heap allocation of the program goes through this replacement of the
+// global operator new (array and nothrow forms included, as they call it), so
+// the allocation check sees those of any container, not only the arena's.
+static std::atomic<size_t> heap_allocations(0);
+
+void *operator new(std::size_t size) {
+    heap_allocations++;
+    if (void *memory = std::malloc(size == 0 ? 1 : size)) return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+static Scenario setup_solar_system() {
+    BodyTable table;
+    generate_solar_system(table);
+    Scenario bodies;
+    unpack_bodies(table, bodies.m, bodies.r, bodies.v);
+    bodies.f.resize(bodies.r.size());
+    return bodies;
+}
+
+static void run_barnes_hut(Scenario bodies, double time_step, double total_time) {
+    auto start = std::chrono::high_resolution_clock::now();
+    BarnesHutWorkspace workspace;
+    for (double t = 0; t < total_time; t += time_step) {
+        barnes_hut_update_step(bodies, workspace, time_step);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> duration = end - start;
+
+    std::cout << "Algorithm: Barnes-Hut Algorithm\n";
+    std::cout << "Simulation Time: " << duration.count() << " seconds\n";
+    std::cout << "Final positions:\n";
+    for (size_t i = 0; i < bodies.r.size(); ++i) {
+        std::cout << "Body " << i + 1 << ": (" << bodies.r[i].x << ", " << bodies.r[i].y << ")\n";
+    }
+}
+
+// After a few warm-up steps have sized the arena, the traversal stack and
+// the refit scratch space, further Barnes-Hut steps must not touch the heap.
+static bool check_barnes_hut_allocations(const Scenario &bodies, double time_step, bool refit) {
+    Scenario scenario = bodies;
+    BarnesHutWorkspace workspace;
+    workspace.refit = refit;
+    for (int step = 0; step < 10; ++step) {
+        barnes_hut_update_step(scenario, workspace, time_step);
+    }
+    size_t warm = heap_allocations.load();
+    for (int step = 0; step < 100; ++step) {
+        barnes_hut_update_step(scenario, workspace, time_step);
+    }
+    size_t allocations = heap_allocations.load() - warm;
+
+    std::cout << "Barnes-Hut steady-state allocations" << (refit ? " with refitting: " : ": ") << allocations
+              << (allocations == 0 ? " (OK)" : " (FAIL)") << "\n";
+    return allocations == 0;
+}
+
+// n bodies at rest in a Gaussian cluster with a dense core
+static void setup_random_cluster(int n, Scenario &bodies) {
+    std::mt19937 rng(305);
+    std::normal_distribution<double> position(0.0, 1e11);
+    std::uniform_real_distribution<double> mass(1e23, 1e25);
+    bodies.m.resize(n);
+    bodies.r.resize(n);
+    bodies.v.assign(n, Vector2D{0, 0});
+    for (int i = 0; i < n; ++i) {
+        bodies.m[i] = mass(rng);
+        bodies.r[i] = Vector2D{position(rng), position(rng)};
+    }
+}
+
+// Seconds per Barnes-Hut step with a new tree every step and with the tree
+// refitted, and how often the refitting workspace still had to rebuild.
+static void report_tree_refit(const Scenario &bodies, double time_step, int steps) {
+    std::cout << "Tree refit (" << bodies.r.size() << " bodies, " << steps << " steps)\n";
+    for (bool refit : {false, true}) {
+        Scenario scenario = bodies;
+        BarnesHutWorkspace workspace;
+        workspace.refit = refit;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int step = 0; step < steps; ++step) {
+            barnes_hut_update_step(scenario, workspace, time_step);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> duration = end - start;
+
+        std::cout << (refit ? "Refit" : "Rebuild") << ": " << duration.count() / steps << " seconds per step, "
+                  << workspace.builds << " builds, " << workspace.refits << " refits";
+        if (refit) std::cout << ", " << workspace.migrants.size() << " bodies changed leaf in the last step";
+        std::cout << "\n";
+    }
+}
+
+// 99th percentile of |F - F_exact| / |F_exact| over every stride-th body, the
+// exact force summed directly.
+static double force_error_p99(const Scenario &bodies, const std::vector<Vector2D> &forces, size_t stride) {
+    std::vector<double> errors;
+    for (size_t i = 0; i < bodies.r.size(); i += stride) {
+        Vector2D exact{0, 0};
+        for (size_t j = 0; j < bodies.r.size(); ++j) {
+            if (j == i) continue;
+            Vector2D dr = bodies.r[j] - bodies.r[i];
+            double dist_sq = dr.norm2();
+            exact += dr * (G * bodies.m[i] * bodies.m[j] / (dist_sq * std::sqrt(dist_sq)));
+        }
+        errors.push_back(std::sqrt((forces[i] - exact).norm2() / exact.norm2()));
+    }
+    std::sort(errors.begin(), errors.end());
+    return errors[errors.size() * 99 / 100];
+}
+
+// Runs `steps` refitting steps, then computes the forces at the final
+// positions once on the refitted tree and once on a new one. The refitted
+// tree's p99 force error against direct summation must stay within
+// `tolerance` times that of the new tree, and the run must have refitted with
+// bodies changing leaf rather than rebuilt every step. A ForceReference
+// measurement in between must not touch the kept tree.
+static bool check_tree_refit(const Scenario &bodies, double time_step, int steps, double tolerance) {
+    Scenario scenario = bodies;
+    BarnesHutWorkspace refitted;
+    refitted.refit = true;
+    size_t migrants = 0;
+    for (int step = 0; step < steps; ++step) {
+        barnes_hut_update_step(scenario, refitted, time_step);
+        migrants += refitted.migrants.size();
+    }
+    // Measuring accuracy with the workspace must leave its tree on these bodies
+    const QuadNode *root = refitted.root;
+    size_t builds = refitted.builds;
+    ForceReference(scenario, 100).measure(scenario, refitted);
+    bool kept = refitted.root == root && refitted.tree_bodies == &scenario && refitted.builds == builds;
+
+    Scenario fresh = scenario;
+    barnes_hut_update_step(scenario, refitted, 0.0);
+    barnes_hut_update_step(fresh, 0.0);
+
+    double refit_error = force_error_p99(scenario, scenario.f, 10);
+    double fresh_error = force_error_p99(fresh, fresh.f, 10);
+    bool passed = refit_error <= tolerance * fresh_error && refitted.refits > 0 && migrants > 0 && kept;
+    std::cout << "Tree refit over " << steps << " steps (" << refitted.builds << " builds, " << refitted.refits << " refits, "
+              << migrants << " bodies changed leaf): p99 force error " << refit_error << ", new tree " << fresh_error
+              << (passed ? " (OK)\n" : " (FAIL)\n");
+    return passed;
+}
+
+// Both linear walks at leaf sizes 1 and 8: the larger leaves must shrink the
+// tree to under half the nodes, and neither walk's p99 force error may exceed
+// max_error.
+static bool check_linear_leaf_sizes(const Scenario &bodies, double max_error) {
+    LinearQuadtree tree;
+    InteractionList list;
+    bool ok = true;
+    size_t leaf_one_nodes = 0;
+    for (int leaf_size : {1, 8}) {
+        Scenario linear = bodies, group = bodies;
+        barnes_hut_update_step_linear(linear, tree, 0.0, leaf_size);
+        size_t nodes = tree.getNodes().size();
+        barnes_hut_update_step_group(group, tree, list, 0.0, 32, leaf_size);
+        double linear_error = force_error_p99(bodies, linear.f, 10);
+        double group_error = force_error_p99(bodies, group.f, 10);
+        if (leaf_size == 1) leaf_one_nodes = nodes;
+        bool passed = linear_error <= max_error && group_error <= max_error && (leaf_size == 1 || 2 * nodes < leaf_one_nodes);
+        std::cout << "Linear walks, leaf size " << leaf_size << ": " << nodes << " nodes, p99 force error " << linear_error
+                  << " per body, " << group_error << " per group" << (passed ? " (OK)\n" : " (FAIL)\n");
+        ok = ok && passed;
+    }
+    return ok;
+}
+
+// FMM forces against direct summation: each (order, theta) pair must stay
+// within its error bound, raising the order must lower the error, and orders
+// above max_order must be clamped.
+static bool check_fmm_forces(const Scenario &bodies) {
+    struct Case {
+        int order;
+        double theta;
+        double max_error;
+    };
+    const Case cases[] = {{2, 0.5, 0.2}, {4, 0.5, 3e-2}, {8, 0.5, 1e-3}, {12, 0.3, 1e-6}};
+    // Orders past the last accurate one are clamped to it
+    bool ok = FmmSolver(16).getOrder() == FmmSolver::max_order;
+    std::cout << "FMM order 16 clamped to " << FmmSolver(16).getOrder() << (ok ? " (OK)\n" : " (FAIL)\n");
+    double previous = INFINITY;
+    for (const Case &c : cases) {
+        Scenario scenario = bodies;
+        FmmSolver solver(c.order, c.theta);
+        solver.computeForces(scenario);
+        double error = force_error_p99(bodies, scenario.f, 10);
+        bool passed = error <= c.max_error && error < previous;
+        std::cout << "FMM order " << c.order << ", theta " << c.theta << ": p99 force error " << error
+                  << (passed ? " (OK)" : " (FAIL)") << "\n";
+        ok = ok && passed;
+        previous = error;
+    }
+    return ok;
+}
+
+// Force error against direct summation for a range of opening angles. The
+// p99 error must stay under the bound for each theta (measured: monopole
+// 0.020, 0.068, 0.20, 0.45; quadrupole 0.0011, 0.0094, 0.044, 0.21 on the
+// 5000-body cluster) and grow with theta. The angle tuned for error_budget,
+// with and without quadrupoles, must then meet it.
+static bool check_force_accuracy(const Scenario &bodies, double error_budget) {
+    struct Case {
+        double angle, monopole_bound, quadrupole_bound;
+    };
+    const Case cases[] = {{0.3, 0.04, 3e-3}, {0.5, 0.1, 0.02}, {0.7, 0.3, 0.08}, {1.0, 0.7, 0.35}};
+    ForceReference reference(bodies, 1000);
+    std::cout << "Force accuracy (" << bodies.r.size() << " bodies, 1000 sampled)\n";
+    bool ok = true;
+    for (bool quadrupole : {false, true}) {
+        double previous = 0;
+        for (const Case &c : cases) {
+            BarnesHutWorkspace workspace;
+            workspace.opening_angle = c.angle;
+            workspace.use_quadrupole = quadrupole;
+            ForceErrorStats stats = reference.measure(bodies, workspace);
+            double p99 = stats.percentile(0.99);
+            bool pass = p99 < (quadrupole ? c.quadrupole_bound : c.monopole_bound) && p99 > previous;
+            previous = p99;
+
+            std::cout << (quadrupole ? "Quadrupole" : "Monopole") << " theta " << c.angle
+                      << ": median " << stats.percentile(0.5) << ", p90 " << stats.percentile(0.9)
+                      << ", p99 " << p99 << ", max " << stats.percentile(1.0)
+                      << ", " << stats.interactions_per_body << " interactions per body" << (pass ? " (OK)\n" : " (FAIL)\n");
+            ok = ok && pass;
+        }
+    }
+
+    // Quadrupoles must afford a larger angle for the same budget
+    double monopole_angle = 0;
+    for (bool quadrupole : {false, true}) {
+        BarnesHutWorkspace workspace;
+        workspace.use_quadrupole = quadrupole;
+        double angle = tune_opening_angle(bodies, workspace, error_budget);
+        workspace.opening_angle = angle;
+        double p99 = reference.measure(bodies, workspace).percentile(0.99);
+        bool pass = angle > 0.05 && p99 <= error_budget && (!quadrupole || angle > monopole_angle);
+        std::cout << "Largest " << (quadrupole ? "quadrupole" : "monopole") << " theta with 99% of force errors within "
+                  << error_budget << ": " << angle << ", p99 " << p99 << (pass ? " (OK)\n" : " (FAIL)\n");
+        ok = ok && pass;
+        monopole_angle = angle;
+    }
+    return ok;
+}
+
+// Relative energy change of the solar system over a year of Barnes-Hut steps
+// at theta 0.5, which must stay below max_drift.
+static bool check_energy_drift(const Scenario &bodies, double time_step, double total_time, double max_drift) {
+    ThreadPool pool;
+    BarnesHutWorkspace workspace;
+    double drift = energy_drift(bodies, workspace, time_step, static_cast<int>(total_time / time_step), pool);
+    bool pass = drift < max_drift;
+    std::cout << "Energy drift over a year at theta " << workspace.opening_angle << ": " << drift
+              << (pass ? " (OK)\n" : " (FAIL)\n");
+    return pass;
+}
+
+int main() {
+    double time_step = 3600; // One hour time step
+    double total_time = 86400 * 365; // One year simulation
+    Scenario solar_system = setup_solar_system();
+
+    run_barnes_hut(solar_system, time_step, total_time);
+    bool ok = check_barnes_hut_allocations(solar_system, time_step, false);
+    ok = check_barnes_hut_allocations(solar_system, time_step, true) && ok;
+
+    Scenario cluster;
+    setup_random_cluster(20000, cluster);
+    report_tree_refit(cluster, time_step, 20);
+
+    BodyTable table;
+    generate_plummer(5000, table);
+    Scenario plummer;
+    unpack_bodies(table, plummer.m, plummer.r, plummer.v);
+    plummer.f.resize(plummer.r.size());
+    ok = check_fmm_forces(plummer) && ok;
+    ok = check_linear_leaf_sizes(plummer, 0.1) && ok;
+    ok = check_tree_refit(plummer, time_step, 50, 1.25) && ok;
+
+    Scenario small_cluster;
+    setup_random_cluster(5000, small_cluster);
+    ok = check_force_accuracy(small_cluster, 1e-3) && ok;
+    ok = check_energy_drift(solar_system, time_step, total_time, 1e-6) && ok;
+
+    return ok ? 0 : 1;
+}
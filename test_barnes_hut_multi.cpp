@@ -0,0 +1,105 @@
+#include "barnes_hut_multi.hpp"
+#include "initial_conditions.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <vector>
+
+// Tests of the multi-threaded Barnes-Hut engine. Each engine has its own
+// Vector2D, so this one has its own program too.
+
+// Every heap allocation of the program goes through this replacement of the
+// global operator new, as in test_barnes_hut.
+static std::atomic<size_t> heap_allocations(0);
+
+void *operator new(std::size_t size) {
+    heap_allocations++;
+    if (void *memory = std::malloc(size == 0 ? 1 : size)) return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+static Scenario setup_plummer(size_t n) {
+    BodyTable table;
+    generate_plummer(n, table);
+    Scenario bodies;
+    unpack_bodies(table, bodies.m, bodies.r, bodies.v);
+    bodies.f.assign(n, Vector2D(0, 0));
+    return bodies;
+}
+
+// Heap allocations per step, over `steps` steps after a few warm-up ones
+static double allocations_per_step(Scenario bodies, ThreadPool &pool, BarnesHutMultiWorkspace *workspace, int steps) {
+    const double time_step = 3600;
+    BarnesHutSettings settings;
+    Metrics metrics(pool.size());
+    BarnesHutMultiWorkspace own;
+    BarnesHutMultiWorkspace &kept = workspace ? *workspace : own;
+    for (int step = 0; step < 5; ++step) {
+        barnes_hut_update_step_multi(bodies, pool, kept, time_step, settings, &metrics);
+    }
+    size_t warm = heap_allocations.load();
+    for (int step = 0; step < steps; ++step) {
+        if (workspace) {
+            barnes_hut_update_step_multi(bodies, pool, *workspace, time_step, settings, &metrics);
+        } else {
+            barnes_hut_update_step_multi(bodies, pool, time_step, settings, &metrics);
+        }
+    }
+    return double(heap_allocations.load() - warm) / steps;
+}
+
+// Once the arenas and walk stacks are sized, a step only allocates for the
+// pool's task objects and the metrics history, however many bodies there
+// are; a new workspace per step allocates every node block and stack again.
+// Measured on 20000 bodies and 4 threads: 7 per step with a kept workspace,
+// 97 without (and 108000 when every node and walk stack was its own).
+static bool check_multi_allocations(const Scenario &bodies, int threads, double max_per_step) {
+    ThreadPool pool(threads);
+    BarnesHutMultiWorkspace workspace;
+    double kept = allocations_per_step(bodies, pool, &workspace, 10);
+    double fresh = allocations_per_step(bodies, pool, nullptr, 10);
+
+    bool ok = kept <= max_per_step;
+    std::cout << "Multi-threaded Barnes-Hut allocations per step (" << bodies.r.size() << " bodies, " << threads
+              << " threads): " << kept << " with a kept workspace, " << fresh << " without" << (ok ? " (OK)" : " (FAIL)") << "\n";
+    return ok;
+}
+
+// A tree built from reused nodes must give the forces of a new one: steps
+// the same bodies with a workspace that already built a tree and with a new
+// workspace, and compares the forces.
+static bool check_multi_reused_tree(const Scenario &bodies, int threads) {
+    const double time_step = 3600;
+    ThreadPool pool(threads);
+    BarnesHutMultiWorkspace workspace;
+    Scenario reused = bodies;
+    barnes_hut_update_step_multi(reused, pool, workspace, time_step);
+    Scenario fresh = reused;
+    barnes_hut_update_step_multi(reused, pool, workspace, time_step);
+    barnes_hut_update_step_multi(fresh, pool, time_step);
+
+    double max_error = 0;
+    for (size_t i = 0; i < bodies.r.size(); ++i) {
+        Vector2D diff = reused.f[i] - fresh.f[i];
+        max_error = std::max(max_error, std::sqrt(diff.norm2() / fresh.f[i].norm2()));
+    }
+
+    bool ok = max_error <= 1e-12;
+    std::cout << "Multi-threaded Barnes-Hut forces on a reused tree against a new one: " << max_error << (ok ? " (OK)" : " (FAIL)")
+              << "\n";
+    return ok;
+}
+
+int main() {
+    Scenario plummer = setup_plummer(20000);
+    bool ok = check_multi_allocations(plummer, 4, 32);
+    ok = check_multi_reused_tree(plummer, 4) && ok;
+    return ok ? 0 : 1;
+}
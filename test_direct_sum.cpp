@@ -0,0 +1,337 @@
+#include "nbody_simulation.hpp"
+#include "integrators.hpp"
+#include "trajectory.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Tests of the direct-sum engine. Each engine has its own Vector2D, so the
+// Barnes-Hut engine has its own program, test_barnes_hut.
+
+struct SolarSystem {
+    std::vector<double> m;
+    std::vector<Vector2D> r, v;
+};
+
+static SolarSystem setup_solar_system() {
+    BodyTable table;
+    generate_solar_system(table);
+    SolarSystem bodies;
+    unpack_bodies(table, bodies.m, bodies.r, bodies.v);
+    return bodies;
+}
+
+static void run_simple_nbody(SolarSystem bodies, double time_step, double total_time) {
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<Vector2D> forces(bodies.r.size());
+    ThreadPool pool;
+    for (double t = 0; t < total_time; t += time_step) {
+        compute_forces(bodies.r.size(), bodies.m, bodies.r, forces, pool);
+        update_bodies(bodies.r.size(), bodies.m, bodies.r, bodies.v, forces, time_step, pool);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> duration = end - start;
+
+    std::cout << "Algorithm: Simple N-Body Algorithm\n";
+    std::cout << "Simulation Time: " << duration.count() << " seconds\n";
+    std::cout << "Final positions:\n";
+    for (size_t i = 0; i < bodies.r.size(); ++i) {
+        std::cout << "Body " << i + 1 << ": (" << bodies.r[i].x << ", " << bodies.r[i].y << ")\n";
+    }
+}
+
+// The SIMD engine (compute_forces_simd), and each tile kernel the CPU
+// supports, against the scalar pairwise compute_forces on Plummer spheres whose
+// sizes leave the padding lanes of the last SIMD block partly or wholly empty,
+// the last over a 1024-body tile boundary. Every body's force must agree to a relative error of max_error.
+static bool check_simd_forces(double max_error) {
+    const double G = 6.67430e-11;
+    ThreadPool pool;
+    BodiesSoA soa;
+    SimdLevel best = detect_simd_level();
+    bool ok = true;
+    for (int n : {1, 3, 7, 9, 17, 1000, 1500}) {
+        BodyTable table;
+        generate_plummer(n, table);
+        SolarSystem bodies;
+        unpack_bodies(table, bodies.m, bodies.r, bodies.v);
+        std::vector<Vector2D> reference, forces;
+        compute_forces(n, bodies.m, bodies.r, reference, pool);
+
+        auto worst_error = [&](const std::vector<Vector2D> &f) {
+            double worst = 0;
+            for (int i = 0; i < n; ++i) {
+                double dx = f[i].x - reference[i].x, dy = f[i].y - reference[i].y;
+                double norm = std::sqrt(reference[i].x * reference[i].x + reference[i].y * reference[i].y);
+                // A lone body feels no force at all, padding included
+                worst = std::max(worst, norm > 0 ? std::sqrt(dx * dx + dy * dy) / norm : std::fabs(f[i].x) + std::fabs(f[i].y));
+            }
+            return worst;
+        };
+
+        compute_forces_simd(n, bodies.m, bodies.r, forces, soa, pool);
+        double error = worst_error(forces);
+        bool passed = error <= max_error;
+        std::cout << "SIMD forces, n=" << n << ": compute_forces_simd " << error;
+        for (SimdLevel level : {SimdLevel::scalar, SimdLevel::avx2, SimdLevel::avx512}) {
+            if (static_cast<int>(level) > static_cast<int>(best)) continue;
+            soa.load(bodies.m, bodies.r);
+            direct_sum_forces(soa, pool, G, level);
+            soa.store_forces(forces);
+            double level_error = worst_error(forces);
+            passed = passed && level_error <= max_error;
+            std::cout << ", " << simd_level_name(level) << " " << level_error;
+        }
+        std::cout << (passed ? " (OK)\n" : " (FAIL)\n");
+        ok = ok && passed;
+    }
+    return ok;
+}
+
+// Energy error and force evaluations of each direct-sum integrator, at the
+// given step and at 10x and 100x longer ones. The largest relative energy
+// error over the run must stay under the bound for the method and step, set a
+// few times above what each one measured, and the force passes must add up to
+// the forces computed on single bodies.
+static bool check_integrator_energy(const SolarSystem &bodies, double time_step, double total_time) {
+    struct Case {
+        Integrator method;
+        double bounds[3]; // For steps of 1x, 10x and 100x time_step
+    };
+    const Case cases[] = {
+        {Integrator::euler, {1e-6, 2e-5, 1e-3}}, // Measured 3.7e-7, 6.9e-6, 4.5e-4
+        {Integrator::leapfrog, {3e-9, 3e-7, 1e-5}}, // 8.0e-10, 7.9e-8, 2.1e-6
+        {Integrator::yoshida4, {1e-13, 1e-9, 1e-5}}, // 1.9e-14, 1.6e-10, 1.8e-6
+        {Integrator::hermite4, {3e-13, 1e-9, 2e-5}}, // 6.7e-14, 1.0e-10, 3.9e-6
+        {Integrator::hermite4_block, {3e-13, 5e-11, 1e-10}}, // 5.2e-14, 6.6e-12, 1.5e-11
+    };
+    ThreadPool pool;
+    bool ok = true;
+    for (const Case &c : cases) {
+        const double factors[3] = {1, 10, 100};
+        for (int f = 0; f < 3; ++f) {
+            double dt = time_step * factors[f];
+            std::vector<Vector2D> r = bodies.r, v = bodies.v, forces;
+            DirectSumIntegrator integrator(c.method, pool);
+            double initial = direct_sum_energy(bodies.m, r, v);
+            double worst = 0;
+            for (double t = 0; t < total_time; t += dt) {
+                integrator.step(bodies.m, r, v, forces, dt);
+                worst = std::max(worst, std::fabs(direct_sum_energy(bodies.m, r, v) / initial - 1));
+            }
+            // Every pass but a block substep computes the forces on all bodies;
+            // a block step takes at least one substep per step
+            size_t n = bodies.m.size(), steps = static_cast<size_t>(std::ceil(total_time / dt));
+            bool counted = c.method == Integrator::hermite4_block
+                ? integrator.forceEvaluations() > steps && integrator.bodyForceEvaluations() <= n * integrator.forceEvaluations()
+                : integrator.bodyForceEvaluations() == n * integrator.forceEvaluations();
+            bool pass = worst < c.bounds[f] && counted;
+            std::cout << "Integrator " << integrator_name(c.method) << ", step " << dt << " s: " << integrator.forceEvaluations()
+                      << " force evaluations (" << integrator.bodyForceEvaluations() << " on single bodies), max relative energy error "
+                      << worst << (pass ? " (OK)\n" : " (FAIL)\n");
+            ok = ok && pass;
+        }
+    }
+    return ok;
+}
+
+// The solar system plus `extra` light bodies on circular orbits between 40
+// and 70 AU, where orbits take a thousand times longer than Mercury's.
+static SolarSystem setup_outer_belt(int extra) {
+    const double G = 6.67430e-11, au = 1.496e11;
+    SolarSystem bodies = setup_solar_system();
+    std::mt19937 rng(305);
+    std::uniform_real_distribution<double> radius(40 * au, 70 * au), phase(0, 2 * M_PI);
+    for (int k = 0; k < extra; ++k) {
+        double r = radius(rng), angle = phase(rng), speed = std::sqrt(G * bodies.m[0] / r);
+        bodies.m.push_back(1e18);
+        bodies.r.push_back(Vector2D{r * std::cos(angle), r * std::sin(angle)});
+        bodies.v.push_back(Vector2D{-speed * std::sin(angle), speed * std::cos(angle)});
+    }
+    return bodies;
+}
+
+// Runs method at time_step for total_time; returns the largest relative energy
+// error and sets the single-body force evaluations.
+static double run_integrator(const SolarSystem &bodies, Integrator method, double time_step, double total_time, size_t &body_forces) {
+    ThreadPool pool;
+    std::vector<Vector2D> r = bodies.r, v = bodies.v, forces;
+    DirectSumIntegrator integrator(method, pool);
+    double initial = direct_sum_energy(bodies.m, r, v);
+    double worst = 0;
+    for (double t = 0; t < total_time; t += time_step) {
+        integrator.step(bodies.m, r, v, forces, time_step);
+        worst = std::max(worst, std::fabs(direct_sum_energy(bodies.m, r, v) / initial - 1));
+    }
+    body_forces = integrator.bodyForceEvaluations();
+    return worst;
+}
+
+// Block steps on a hierarchical system: hermite4_block at a 64 day maximum step
+// must reach at least the energy accuracy of hermite4 at a one day step with
+// under a tenth of its single-body force evaluations (measured: 5692 forces
+// for 2.1e-9 against 113094 for 5.0e-9).
+static bool check_block_time_steps(double total_time) {
+    SolarSystem bodies = setup_outer_belt(300);
+    size_t fixed_forces = 0, block_forces = 0;
+    double fixed_error = run_integrator(bodies, Integrator::hermite4, 86400, total_time, fixed_forces);
+    double block_error = run_integrator(bodies, Integrator::hermite4_block, 64 * 86400, total_time, block_forces);
+    bool passed = block_error <= fixed_error && 10 * block_forces < fixed_forces;
+    std::cout << "Block steps, " << bodies.m.size() << " bodies: hermite4 at 1 d " << fixed_forces << " single-body forces, energy error "
+              << fixed_error << "; hermite4_block at 64 d " << block_forces << ", energy error " << block_error
+              << (passed ? " (OK)\n" : " (FAIL)\n");
+    return passed;
+}
+
+// Rewrites the uint64 at byte offset `at` (from the end if negative) of a copy
+// of the trajectory file at `path`, and returns whether the reader accepts it.
+static bool reader_accepts_patched(const std::string &path, long at, uint64_t value) {
+    std::ifstream in(path, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t offset = at < 0 ? bytes.size() + at : at;
+    std::memcpy(&bytes[offset], &value, sizeof(value));
+    const std::string patched = path + ".patched";
+    std::ofstream(patched, std::ios::binary).write(bytes.data(), bytes.size());
+    TrajectoryReader reader;
+    bool accepted = reader.open(patched);
+    std::remove(patched.c_str());
+    return accepted;
+}
+
+// Writes a few frames over several chunks, reads them back, and checks that
+// the reader rejects files whose header or footer is inconsistent with them.
+static bool check_trajectory(const SolarSystem &bodies) {
+    const std::string path = "test_direct_sum.traj";
+    const size_t frames = 10;
+    const size_t frame_bytes = (1 + 6 * bodies.r.size()) * sizeof(double);
+    {
+        TrajectoryWriter writer(path, bodies.r.size(), 3 * frame_bytes);
+        std::vector<Vector2D> forces(bodies.r.size());
+        for (size_t frame = 0; frame < frames; ++frame) writer.append(frame, bodies.r, bodies.v, forces);
+    }
+
+    bool ok = true;
+    TrajectoryReader reader;
+    std::vector<Vector2D> r, v, f;
+    if (!reader.open(path) || reader.numFrames() != frames || reader.numBodies() != bodies.r.size() ||
+        reader.time(frames - 1) != frames - 1 || !reader.readFrame(frames - 1, r, v, f) || r[3].x != bodies.r[3].x) {
+        std::cout << "Trajectory round trip (FAIL)\n";
+        ok = false;
+    }
+    if (reader.readFrame(frames, r, v, f) || reader.component(frames, 0) != nullptr || !std::isnan(reader.time(frames))) {
+        std::cout << "Trajectory frame past the end (FAIL)\n";
+        ok = false;
+    }
+    // A writer whose file did not open must drop its frames, not buffer them
+    TrajectoryWriter unopened("no_such_directory/test_direct_sum.traj", bodies.r.size(), frame_bytes);
+    for (size_t frame = 0; frame < frames; ++frame) unopened.append(frame, bodies.r, bodies.v, bodies.v);
+    if (unopened.isOpen() || unopened.numFrames() != 0) {
+        std::cout << "Trajectory writer without a file (FAIL)\n";
+        ok = false;
+    }
+
+    // Header: magic, num_bodies, frames_per_chunk. Footer: 4 chunk offsets,
+    // num_chunks, num_frames, magic.
+    struct Corruption {
+        const char *name;
+        long at;
+        uint64_t value;
+    };
+    const Corruption corruptions[] = {
+        {"zero frames per chunk", 16, 0},
+        {"too many bodies", 8, 1000000},
+        {"num_frames beyond the chunks", -16, frames + 3},
+        {"num_frames short of the chunks", -16, frames - 3},
+        {"chunk offset past the frames", -24 - 8, 1 << 20},
+        {"chunk offset inside the header", -24 - 32, 8},
+    };
+    for (const Corruption &corruption : corruptions) {
+        bool accepted = reader_accepts_patched(path, corruption.at, corruption.value);
+        std::cout << "Trajectory with " << corruption.name << (accepted ? " accepted (FAIL)\n" : " rejected (OK)\n");
+        ok = ok && !accepted;
+    }
+    std::remove(path.c_str());
+    return ok;
+}
+
+// Loads each CSV text through load_csv and checks that only the well-formed
+// ones are accepted.
+static bool check_csv_parsing() {
+    struct Case {
+        const char *name;
+        std::string text;
+        bool valid;
+    };
+    const Case cases[] = {
+        {"commas and CRLF", "# m, x, y, vx, vy\r\n1, 2, 3, 4, 5\r\n2,0,0,0,1e3\r\n", true},
+        {"whitespace, no final newline", "1 2 3 4 5\n2\t0 0 0 -1.5", true},
+        {"a sixth field", "1, 2, 3, 4, 5, 6\n", false},
+        {"trailing comma", "1, 2, 3, 4, 5,\n", false},
+        {"four fields", "1, 2, 3, 4\n", false},
+        {"a line over 256 characters", "1, 2, 3, 4, 5" + std::string(300, ' ') + "6\n", false},
+        {"a number over 64 characters", "1, 2, 3, 4, 0." + std::string(80, '1') + "\n", false},
+        {"junk after a number", "1, 2, 3x, 4, 5\n", false},
+    };
+    const std::string path = "test_direct_sum.csv";
+    ThreadPool pool;
+    bool ok = true;
+    for (const Case &c : cases) {
+        std::ofstream(path, std::ios::binary) << c.text;
+        BodyTable table;
+        bool accepted = load_csv(path, table, pool);
+        bool pass = accepted == c.valid && (!accepted || table.size() == 2);
+        std::cout << "CSV with " << c.name << (accepted ? " accepted" : " rejected") << (pass ? " (OK)\n" : " (FAIL)\n");
+        ok = ok && pass;
+    }
+    std::remove(path.c_str());
+    return ok;
+}
+
+// Saves three bodies with save_binary and loads them back, then checks that
+// load_binary rejects a body count whose size 16 + 40 n wraps around to the
+// file's size, and one the file is too short for.
+static bool check_binary_loading() {
+    const std::string path = "test_direct_sum.bin";
+    BodyTable table;
+    generate_plummer(3, table);
+    ThreadPool pool;
+    BodyTable loaded;
+    bool ok = save_binary(path, table) && load_binary(path, loaded, pool) && loaded.size() == 3 && loaded.x[2] == table.x[2];
+    std::cout << "Binary bodies round trip" << (ok ? " (OK)\n" : " (FAIL)\n");
+
+    const uint64_t counts[] = {3 + (uint64_t(1) << 61), 4};
+    for (uint64_t n : counts) {
+        std::ifstream in(path, std::ios::binary);
+        std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::memcpy(&bytes[8], &n, sizeof(n));
+        const std::string patched = path + ".patched";
+        std::ofstream(patched, std::ios::binary).write(bytes.data(), bytes.size());
+        bool accepted = load_binary(patched, loaded, pool);
+        std::remove(patched.c_str());
+        std::cout << "Binary bodies with n = " << n << (accepted ? " accepted (FAIL)\n" : " rejected (OK)\n");
+        ok = ok && !accepted;
+    }
+    std::remove(path.c_str());
+    return ok;
+}
+
+int main() {
+    double time_step = 3600; // One hour time step
+    double total_time = 86400 * 365; // One year simulation
+    SolarSystem bodies = setup_solar_system();
+
+    run_simple_nbody(bodies, time_step, total_time);
+    bool ok = check_simd_forces(1e-12);
+    ok = check_integrator_energy(bodies, time_step, total_time) && ok;
+    ok = check_block_time_steps(total_time) && ok;
+    ok = check_trajectory(bodies) && ok;
+    ok = check_csv_parsing() && ok;
+    ok = check_binary_loading() && ok;
+    return ok ? 0 : 1;
+}
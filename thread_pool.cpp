@@ -0,0 +1,130 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+
+ThreadPool::ThreadPool(int num_threads) : num_threads(num_threads) {
+    if (this->num_threads <= 0) {
+        this->num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    steal_ranges = std::vector<StealRange>(this->num_threads);
+    for (int i = 1; i < this->num_threads; ++i) {
+        workers.emplace_back(&ThreadPool::worker_loop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start_cv.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::worker_loop(int thread_id) {
+    unsigned long seen_generation = 0;
+    while (true) {
+        const std::function<void(int)> *current;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cv.wait(lock, [&] { return stopping || job_generation != seen_generation; });
+            if (stopping) return;
+            seen_generation = job_generation;
+            current = task;
+        }
+
+        (*current)(thread_id);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0) done_cv.notify_one();
+    }
+}
+
+void ThreadPool::run(const std::function<void(int)> &task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->task = &task;
+        pending = num_threads - 1;
+        ++job_generation;
+    }
+    start_cv.notify_all();
+
+    task(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&] { return pending == 0; });
+    this->task = nullptr;
+}
+
+void ThreadPool::parallel_for(int begin, int end, const std::function<void(int, int, int)> &body) {
+    int chunk_size = (end - begin + num_threads - 1) / num_threads;
+    run([&](int thread_id) {
+        int start = begin + thread_id * chunk_size;
+        int stop = std::min(start + chunk_size, end);
+        if (start < stop) {
+            body(start, stop, thread_id);
+        }
+    });
+}
+
+static bool take_chunk(std::atomic<uint64_t> &range, bool from_back, uint32_t &chunk) {
+    uint64_t current = range.load();
+    while (true) {
+        uint32_t lo = current & 0xffffffffu;
+        uint32_t hi = current >> 32;
+        if (lo >= hi) return false;
+        uint64_t next = from_back ? (uint64_t(hi - 1) << 32 | lo) : (uint64_t(hi) << 32 | (lo + 1));
+        if (range.compare_exchange_weak(current, next)) {
+            chunk = from_back ? hi - 1 : lo;
+            return true;
+        }
+    }
+}
+
+void ThreadPool::parallel_for_stealing(int begin, int end, int chunk_size, const std::function<void(int, int, int)> &body) {
+    if (end <= begin) return;
+    chunk_size = std::max(1, chunk_size);
+    uint64_t num_chunks = (end - begin + chunk_size - 1) / chunk_size;
+    for (int t = 0; t < num_threads; ++t) {
+        uint64_t lo = num_chunks * t / num_threads;
+        uint64_t hi = num_chunks * (t + 1) / num_threads;
+        steal_ranges[t].range.store(hi << 32 | lo);
+    }
+
+    run([&](int thread_id) {
+        auto process = [&](uint32_t chunk) {
+            int start = begin + chunk * chunk_size;
+            body(start, std::min(start + chunk_size, end), thread_id);
+        };
+
+        uint32_t chunk;
+        while (take_chunk(steal_ranges[thread_id].range, false, chunk)) process(chunk);
+
+        // Own deque is empty: steal until a full sweep finds nothing left
+        bool stole = true;
+        while (stole) {
+            stole = false;
+            for (int k = 1; k < num_threads; ++k) {
+                int victim = (thread_id + k) % num_threads;
+                if (take_chunk(steal_ranges[victim].range, true, chunk)) {
+                    process(chunk);
+                    stole = true;
+                    break;
+                }
+            }
+        }
+    });
+}
+
+void ThreadPool::barrier() {
+    std::unique_lock<std::mutex> lock(barrier_mutex);
+    unsigned long generation = barrier_generation;
+    if (++barrier_waiting == num_threads) {
+        barrier_waiting = 0;
+        ++barrier_generation;
+        barrier_cv.notify_all();
+        return;
+    }
+    barrier_cv.wait(lock, [&] { return barrier_generation != generation; });
+}
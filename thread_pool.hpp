@@ -0,0 +1,72 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads kept alive for the whole simulation, so that a
+// time step does not pay for creating and joining threads. The calling thread
+// takes part in every job as thread 0.
+class ThreadPool {
+public:
+    // num_threads <= 0 means one thread per hardware core.
+    explicit ThreadPool(int num_threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    int size() const { return num_threads; }
+
+    // Runs task(thread_id) once on every thread of the pool and returns when all
+    // of them are done.
+    void run(const std::function<void(int)> &task);
+
+    // Splits [begin, end) into size() contiguous chunks and runs
+    // body(start, end, thread_id) on each of them.
+    void parallel_for(int begin, int end, const std::function<void(int, int, int)> &body);
+
+    // Like parallel_for, but [begin, end) is cut into chunks of chunk_size and
+    // each thread gets a deque of them. A thread that runs out of chunks steals
+    // from the far end of another thread's deque, so uneven chunk costs still
+    // keep every thread busy.
+    void parallel_for_stealing(int begin, int end, int chunk_size, const std::function<void(int, int, int)> &body);
+
+    // Blocks until every thread of the pool reaches the barrier. Only valid
+    // from inside a task passed to run().
+    void barrier();
+
+private:
+    void worker_loop(int thread_id);
+
+    // Chunks [lo, hi) still queued for one thread, packed as lo | hi << 32 so
+    // the owner (taking lo) and thieves (taking hi - 1) claim with one CAS.
+    struct StealRange {
+        std::atomic<uint64_t> range;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    std::vector<StealRange> steal_ranges;
+
+    int num_threads;
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    const std::function<void(int)> *task = nullptr;
+    unsigned long job_generation = 0;
+    int pending = 0;
+    bool stopping = false;
+
+    std::mutex barrier_mutex;
+    std::condition_variable barrier_cv;
+    int barrier_waiting = 0;
+    unsigned long barrier_generation = 0;
+};
+
+#endif // THREAD_POOL_HPP
@@ -0,0 +1,118 @@
+#include "trace.hpp"
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> trace_active(false);
+
+struct TraceEvent {
+    const char *name;
+    int64_t start_ns; // Since trace_start()
+    int64_t duration_ns;
+    int64_t detail;
+};
+
+// Written only by its own thread; head counts every event ever recorded, so
+// head - capacity is the oldest one still in the buffer.
+struct TraceBuffer {
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> head{0};
+    int tid;
+};
+
+static std::mutex registry_mutex;
+static std::vector<std::unique_ptr<TraceBuffer>> buffers;
+static std::string trace_path;
+static size_t trace_capacity = default_trace_capacity;
+static std::chrono::steady_clock::time_point trace_origin;
+// Bumped by every trace_start() so threads drop buffers of an earlier trace
+static unsigned long trace_generation = 0;
+
+static thread_local TraceBuffer *thread_buffer = nullptr;
+static thread_local unsigned long thread_generation = 0;
+
+static TraceBuffer *current_buffer() {
+    if (thread_buffer == nullptr || thread_generation != trace_generation) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        std::unique_ptr<TraceBuffer> buffer(new TraceBuffer());
+        buffer->events.resize(trace_capacity);
+        buffer->tid = buffers.size();
+        thread_buffer = buffer.get();
+        thread_generation = trace_generation;
+        buffers.push_back(std::move(buffer));
+    }
+    return thread_buffer;
+}
+
+static int64_t nanoseconds(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+bool trace_start(const std::string &path, size_t events_per_thread) {
+    // Fail now rather than after the run
+    if (!std::ofstream(path)) {
+        std::cerr << "Error: Cannot write trace to " << path << "\n";
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    trace_capacity = 1;
+    while (trace_capacity < events_per_thread) trace_capacity <<= 1;
+    buffers.clear();
+    trace_path = path;
+    trace_origin = std::chrono::steady_clock::now();
+    ++trace_generation;
+    trace_active.store(true);
+    return true;
+}
+
+void TraceScope::record() {
+    TraceBuffer *buffer = current_buffer();
+    uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    TraceEvent &event = buffer->events[head & (buffer->events.size() - 1)];
+    event.name = name;
+    event.start_ns = nanoseconds(start - trace_origin);
+    event.duration_ns = nanoseconds(std::chrono::steady_clock::now() - start);
+    event.detail = detail;
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+bool trace_stop() {
+    if (!trace_active.exchange(false)) return false;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    std::ofstream out(trace_path);
+    if (!out) {
+        std::cerr << "Error: Cannot write trace to " << trace_path << "\n";
+        return false;
+    }
+
+    // Timestamps are in microseconds
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out.precision(3);
+    out << std::fixed;
+    bool first = true;
+    for (const auto &buffer : buffers) {
+        out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->tid
+            << ", \"args\": {\"name\": \"thread " << buffer->tid << "\"}}";
+        first = false;
+
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        uint64_t capacity = buffer->events.size();
+        if (head > capacity) {
+            std::cerr << "Trace buffer of thread " << buffer->tid << " wrapped, " << head - capacity << " events dropped\n";
+        }
+        for (uint64_t k = head > capacity ? head - capacity : 0; k < head; ++k) {
+            const TraceEvent &event = buffer->events[k & (capacity - 1)];
+            out << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->tid
+                << ", \"ts\": " << event.start_ns / 1e3 << ", \"dur\": " << event.duration_ns / 1e3;
+            if (event.detail >= 0) out << ", \"args\": {\"detail\": " << event.detail << "}";
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+    buffers.clear();
+    return static_cast<bool>(out);
+}
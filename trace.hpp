@@ -0,0 +1,58 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Timeline recording in the Chrome trace-event format, for chrome://tracing or
+// ui.perfetto.dev. Between trace_start() and trace_stop() every TraceScope
+// records one event (name, thread, start, duration) into a ring buffer owned
+// by the thread that runs it, so recording takes no lock; once a buffer is
+// full its oldest events are overwritten. trace_stop() writes the file. Both
+// must be called while no traced code is running.
+//
+// While tracing is off a scope costs one relaxed atomic load.
+
+// Events kept per thread; rounded up to a power of two.
+const size_t default_trace_capacity = 1 << 16;
+
+// Returns false if path cannot be written.
+bool trace_start(const std::string &path, size_t events_per_thread = default_trace_capacity);
+// Writes the recorded events and turns tracing off. Returns false if the file
+// cannot be written or tracing was not started.
+bool trace_stop();
+
+extern std::atomic<bool> trace_active;
+
+inline bool trace_enabled() {
+    return trace_active.load(std::memory_order_relaxed);
+}
+
+// Records the span of its own lifetime. name must outlive the trace (a string
+// literal); detail, if not negative, is shown with the event (e.g. the first
+// body of a chunk).
+class TraceScope {
+public:
+    explicit TraceScope(const char *name, int64_t detail = -1) : name(name), detail(detail), enabled(trace_enabled()) {
+        if (enabled) start = std::chrono::steady_clock::now();
+    }
+
+    ~TraceScope() {
+        if (enabled) record();
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    void record();
+
+    const char *name;
+    int64_t detail;
+    bool enabled;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif // TRACE_HPP
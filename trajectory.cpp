@@ -0,0 +1,137 @@
+#include "trajectory.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char header_magic[8] = {'N', 'B', 'T', 'R', 'A', 'J', '0', '1'};
+static const char footer_magic[8] = {'N', 'B', 'T', 'R', 'I', 'D', 'X', '1'};
+static const size_t header_size = 8 + 2 * sizeof(uint64_t);
+static const size_t trailer_size = 2 * sizeof(uint64_t) + 8;
+
+TrajectoryWriter::TrajectoryWriter(const std::string &path, size_t num_bodies, size_t chunk_bytes)
+    : file(path, std::ios::binary | std::ios::trunc),
+      num_bodies(num_bodies),
+      frames_per_chunk(std::max<size_t>(1, chunk_bytes / ((1 + 6 * num_bodies) * sizeof(double)))) {
+    if (!file.is_open()) {
+        std::cerr << "Error: cannot open trajectory file " << path << "\n";
+        return;
+    }
+    uint64_t header[2] = {num_bodies, this->frames_per_chunk};
+    file.write(header_magic, sizeof(header_magic));
+    file.write(reinterpret_cast<const char *>(header), sizeof(header));
+    chunk.reserve(this->frames_per_chunk * (1 + 6 * num_bodies));
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+    close();
+}
+
+void TrajectoryWriter::flushChunk() {
+    if (frames_in_chunk == 0 || !file.is_open()) return;
+    chunk_offsets.push_back(file.tellp());
+    file.write(reinterpret_cast<const char *>(chunk.data()), chunk.size() * sizeof(double));
+    chunk.clear();
+    frames_in_chunk = 0;
+}
+
+void TrajectoryWriter::close() {
+    if (!file.is_open()) return;
+    flushChunk();
+    uint64_t trailer[2] = {chunk_offsets.size(), num_frames};
+    file.write(reinterpret_cast<const char *>(chunk_offsets.data()), chunk_offsets.size() * sizeof(uint64_t));
+    file.write(reinterpret_cast<const char *>(trailer), sizeof(trailer));
+    file.write(footer_magic, sizeof(footer_magic));
+    file.close();
+}
+
+TrajectoryReader::~TrajectoryReader() {
+    unmap();
+}
+
+void TrajectoryReader::unmap() {
+    if (data) munmap(const_cast<char *>(data), size);
+    data = nullptr;
+    size = 0;
+    num_bodies = 0;
+    frames_per_chunk = 0;
+    num_frames = 0;
+    chunk_offsets = nullptr;
+}
+
+bool TrajectoryReader::open(const std::string &path) {
+    unmap();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error: cannot open trajectory file " << path << "\n";
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < header_size + trailer_size) {
+        std::cerr << "Error: " << path << " is not a trajectory file\n";
+        ::close(fd);
+        return false;
+    }
+    size = info.st_size;
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Error: cannot map trajectory file " << path << "\n";
+        size = 0;
+        return false;
+    }
+    data = static_cast<const char *>(mapped);
+
+    const char *trailer = data + size - trailer_size;
+    uint64_t num_chunks;
+    uint64_t frames;
+    std::memcpy(&num_chunks, trailer, sizeof(uint64_t));
+    std::memcpy(&frames, trailer + sizeof(uint64_t), sizeof(uint64_t));
+    if (size % sizeof(uint64_t) != 0 || std::memcmp(data, header_magic, 8) != 0 || std::memcmp(trailer + 2 * sizeof(uint64_t), footer_magic, 8) != 0 ||
+        num_chunks > (size - header_size - trailer_size) / sizeof(uint64_t)) {
+        std::cerr << "Error: " << path << " is not a complete trajectory file\n";
+        unmap();
+        return false;
+    }
+
+    uint64_t header[2];
+    std::memcpy(header, data + 8, sizeof(header));
+    num_bodies = header[0];
+    frames_per_chunk = header[1];
+    num_frames = frames;
+    chunk_offsets = reinterpret_cast<const uint64_t *>(trailer - num_chunks * sizeof(uint64_t));
+    if (!validate(num_chunks)) {
+        std::cerr << "Error: " << path << " has a corrupt trajectory header or index\n";
+        unmap();
+        return false;
+    }
+    return true;
+}
+
+// Checks the header and footer against each other and every chunk against the
+// mapped size, so that frameData() never reads outside the file.
+bool TrajectoryReader::validate(size_t num_chunks) const {
+    size_t frames_end = size - trailer_size - num_chunks * sizeof(uint64_t);
+    if (frames_per_chunk == 0) return false;
+    if (num_frames / frames_per_chunk + (num_frames % frames_per_chunk != 0) != num_chunks) return false;
+    if (num_frames > 0 && num_bodies > (frames_end - header_size) / (6 * sizeof(double))) return false;
+
+    size_t frame_bytes = (1 + 6 * num_bodies) * sizeof(double);
+    for (size_t c = 0; c < num_chunks; ++c) {
+        uint64_t offset = chunk_offsets[c];
+        size_t frames_in_chunk = std::min<size_t>(frames_per_chunk, num_frames - c * frames_per_chunk);
+        if (offset < header_size || offset > frames_end || offset % sizeof(double) != 0 ||
+            frames_in_chunk > (frames_end - offset) / frame_bytes) return false;
+    }
+    return true;
+}
+
+const double *TrajectoryReader::frameData(size_t frame) const {
+    if (frame >= num_frames) return nullptr;
+    size_t frame_size = 1 + 6 * num_bodies;
+    const char *chunk = data + chunk_offsets[frame / frames_per_chunk];
+    return reinterpret_cast<const double *>(chunk) + (frame % frames_per_chunk) * frame_size;
+}
@@ -0,0 +1,129 @@
+#ifndef TRAJECTORY_HPP
+#define TRAJECTORY_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Binary trajectory file.
+//
+//   header : "NBTRAJ01", uint64 num_bodies, uint64 frames_per_chunk
+//   chunks : up to frames_per_chunk frames each; a frame is the time followed
+//            by x, y, vx, vy, fx, fy for every body, all as doubles
+//   footer : uint64 offset of every chunk, then uint64 num_chunks,
+//            uint64 num_frames and "NBTRIDX1"
+//
+// Frames are buffered and written one chunk at a time, so memory use does not
+// grow with the length of the run; the footer lets a reader find any frame in
+// O(1). A chunk holds as many frames as fit in chunk_bytes, and at least one.
+class TrajectoryWriter {
+public:
+    TrajectoryWriter(const std::string &path, size_t num_bodies, size_t chunk_bytes = 4 << 20);
+    ~TrajectoryWriter();
+
+    TrajectoryWriter(const TrajectoryWriter &) = delete;
+    TrajectoryWriter &operator=(const TrajectoryWriter &) = delete;
+
+    bool isOpen() const { return file.is_open(); }
+    size_t numFrames() const { return num_frames; }
+
+    // Records one frame from any containers whose elements have .x and .y.
+    // Does nothing if the file failed to open or is closed.
+    template <typename Vec>
+    void append(double time, const std::vector<Vec> &r, const std::vector<Vec> &v, const std::vector<Vec> &f) {
+        if (!file.is_open()) return;
+        chunk.push_back(time);
+        pushComponents(r);
+        pushComponents(v);
+        pushComponents(f);
+        num_frames++;
+        if (++frames_in_chunk == frames_per_chunk) flushChunk();
+    }
+
+    // Writes the last partial chunk and the footer. Called by the destructor.
+    void close();
+
+private:
+    template <typename Vec>
+    void pushComponents(const std::vector<Vec> &values) {
+        for (size_t i = 0; i < num_bodies; ++i) chunk.push_back(i < values.size() ? values[i].x : 0.0);
+        for (size_t i = 0; i < num_bodies; ++i) chunk.push_back(i < values.size() ? values[i].y : 0.0);
+    }
+    void flushChunk();
+
+    std::ofstream file;
+    size_t num_bodies;
+    size_t frames_per_chunk;
+    size_t frames_in_chunk = 0;
+    size_t num_frames = 0;
+    std::vector<double> chunk;
+    std::vector<uint64_t> chunk_offsets;
+};
+
+// Read side: maps the whole file and locates frames through the footer.
+class TrajectoryReader {
+public:
+    TrajectoryReader() {}
+    ~TrajectoryReader();
+
+    TrajectoryReader(const TrajectoryReader &) = delete;
+    TrajectoryReader &operator=(const TrajectoryReader &) = delete;
+
+    // Returns false (and reports on std::cerr) if the file is missing, not a
+    // complete trajectory, or has a header or footer that does not match its
+    // size; the frames of an accepted file all lie inside the mapping.
+    bool open(const std::string &path);
+
+    size_t numBodies() const { return num_bodies; }
+    size_t numFrames() const { return num_frames; }
+
+    // Frames past numFrames() have no time (NaN), no components (nullptr) and
+    // are not read (false).
+    double time(size_t frame) const {
+        const double *values = frameData(frame);
+        return values ? *values : std::numeric_limits<double>::quiet_NaN();
+    }
+    // Start of the x, y, vx, vy, fx or fy array (component 0..5) of a frame
+    const double *component(size_t frame, int which) const {
+        const double *values = frameData(frame);
+        return values ? values + 1 + which * num_bodies : nullptr;
+    }
+
+    template <typename Vec>
+    bool readFrame(size_t frame, std::vector<Vec> &r, std::vector<Vec> &v, std::vector<Vec> &f) const {
+        if (frame >= num_frames) return false;
+        unpack(frame, 0, r);
+        unpack(frame, 2, v);
+        unpack(frame, 4, f);
+        return true;
+    }
+
+private:
+    // nullptr if frame is out of range
+    const double *frameData(size_t frame) const;
+
+    template <typename Vec>
+    void unpack(size_t frame, int which, std::vector<Vec> &out) const {
+        const double *x = component(frame, which);
+        const double *y = component(frame, which + 1);
+        out.resize(num_bodies);
+        for (size_t i = 0; i < num_bodies; ++i) {
+            out[i].x = x[i];
+            out[i].y = y[i];
+        }
+    }
+
+    bool validate(size_t num_chunks) const;
+    void unmap();
+
+    const char *data = nullptr;
+    size_t size = 0;
+    size_t num_bodies = 0;
+    size_t frames_per_chunk = 0;
+    size_t num_frames = 0;
+    const uint64_t *chunk_offsets = nullptr;
+};
+
+#endif // TRAJECTORY_HPP